@@ -6,25 +6,164 @@
 * it a much better option for large datasets.
 *
 * USAGE:
-*   kde(x,d,bw);
+*   yhat = kdee(x,d,bw);
+*   [yhat,ehat,info] = kdee(x,d,bw);
+*   [yhat,ehat,info,stats] = kdee(x,d,bw);
+*   [...] = kdee(x,d,'sj');
+*   [...] = kdee(x,d,bw,'OptionalArgName1',OptionalArgValue1,...);
 *
 * INPUT:
 *    x (double[]): The x-domain values of the data to be regressed.
 *    d (double[]): The exact x-domain to fit the regression function.
-*   bw (double): The kernel bandwidth.
+*   bw (double): The kernel bandwidth (for the von Mises kernel, the
+*                concentration kappa; see 'kernel'). Or, the name of a
+*                bandwidth selector (Gaussian kernel only):
+*                  'silverman' - Silverman's rule (as in kde.m),
+*                                0.9*min(std(x), iqr(x)/1.34)*m^(-1/5).
+*                  'sj'        - Sheather-Jones solve-the-equation plug-in.
+*                  'lscv'      - Least-squares cross-validation (the global
+*                                minimum of a scan, refined).
+*                'sj' and 'lscv' search around the normal reference
+*                bandwidth, as R's bw.SJ() and bw.ucv() do. Their density
+*                functionals are estimated from the data binned onto 8192
+*                grid points, so that selection costs O(m) (e.g., well under
+*                a second for 10^7 data). Unlike Silverman's rule, they do
+*                not oversmooth multimodal data. With 'weights', the sample
+*                size is the effective sample size sum(w)^2/sum(w.^2) (and
+*                the std is the unbiased weighted std), so the selected
+*                bandwidth does not depend on the scale of the weights.
+*                Only the data within 'bounds' are used. The selected
+*                bandwidth is returned in 'info'.
+*   'x' and 'd' may also be of class single, int16 or int32. They are read
+*   directly (without a conversion by MATLAB) and accumulated in double.
+*
+* OPTIONAL NAME-VALUE PAIRS:
+*     'method': 'exact' (default) or 'binned'. The binned approximation
+*               linearly bins 'x' onto a grid, convolves the bin counts
+*               with the kernel, and interpolates onto 'd'. Its cost is
+*               O(m + G*L) for m data, G grid points and a kernel spanning
+*               L grid points, and does not require sorting 'x'.
+*   'gridsize': Number of grid points for the binned approximation. The
+*               grid spans the data (within 'bounds'), 'd' and, with
+*               'reflect', a kernel half-width beyond them. By default,
+*               there are 16 grid points per bandwidth (minimum 4096,
+*               maximum 2^22).
+*     'output': 'double' (default) or 'single'. The class of 'yhat' and
+*               'ehat'. They are always computed in double precision.
+*    'weights': Non-negative observation weights, one per element of 'x'
+*               (e.g., the number of repeats of each unique value). Each
+*               kernel is scaled by the weight of its datum and the density
+*               is normalized by the sum of the weights, so that weighted
+*               unique values give the density of the repeated data.
+*               Data with a weight of 0 or NaN are excluded.
+*      'error': The error returned in 'ehat':
+*                 'rms' - (default) The (weighted) RMS deviation of the data
+*                         from 'yhat', i.e., sqrt( mean((x-yhat).^2) ),
+*                         computed from the mean and variance of the data.
+*                 'se'  - The standard error of 'yhat'. The kernel terms of
+*                         the data are a sample whose mean is 'yhat', so
+*                         ehat = sqrt( (mean(K.^2) - yhat.^2) / n ), where
+*                         n is the effective sample size sum(w)^2/sum(w.^2)
+*                         (m for equal weights), and only the data in the
+*                         kernel window contribute to mean(K.^2) (for the
+*                         binned approximation, the bin counts are also
+*                         convolved with the squared kernel).
+*     'kernel': 'gauss' (default) or 'vonmises'. The von Mises (circular
+*               Gaussian) kernel, exp(bw*cos(x-d))/(2*pi*besseli(0,bw)),
+*               for angles in radians (e.g., saccade directions). The data
+*               are wrapped onto [-pi, pi), and the window of each point of
+*               'd' wraps around the circle. The cos() and sin() of the data
+*               are computed once (and of 'd' by angle-addition recurrences
+*               if it is equally spaced), so the cost is that of the
+*               Gaussian kernel. Not available with 'binned', 'bounds' or
+*               'cdf'.
+*       'dist': 'pdf' (default) or 'cdf'. The CDF is the exact smoothed
+*               CDF, sum( Phi((d-x)/bw) )/m (weighted like the PDF). The
+*               kernel CDFs of the data more than 9 bandwidths below 'd'
+*               are 1 in double precision, so they are counted from the
+*               sorted data, and only the window needs erfc(). For 'se',
+*               the kernel terms are the kernel CDFs. The binned
+*               approximation convolves the bin counts with the kernel CDF
+*               (e.g., milliseconds for 10^6 points of 'd'), whereas the
+*               exact CDF costs an erfc() per datum in each window. Not
+*               available with 'bounds'.
+*     'bounds': [lo hi], the bounds of the support of the density (e.g.,
+*               [0 Inf] for reaction times or pupil area). Either may be
+*               infinite. Data outside the bounds are ignored, and 'yhat'
+*               and 'ehat' are 0 outside the bounds. Default: unbounded.
+*   'boundary': The correction of the density near the bounds:
+*                 'truncate' - (default) The kernel is truncated at the
+*                              bounds, and renormalized by the mass of the
+*                              kernel within the bounds at each point of
+*                              'd' (two erf() per point).
+*                 'reflect'  - The data are reflected about the bounds.
+*                              Only the data within a few bandwidths of a
+*                              bound have reflections within reach of the
+*                              kernel, and they are already in the kernel
+*                              window, so the cost is unchanged.
+*               Both estimates integrate to 1 within the bounds. The
+*               standard error of a reflected density is not available for
+*               the binned approximation.
 *
 * OUTPUT:
-*   yhat (double[]): The fitted KDE function. Equal length to 'd'.
-*   ehat (double[]): The fitted KDE function error. Equal length to
-*                    'd'.
+*   yhat (double[]): The fitted KDE function (the PDF or CDF, see 'dist').
+*                    Equal length to 'd'.
+*   ehat (double[]): The fitted KDE function error (see 'error'). Equal
+*                    length to 'd'. Either error costs O(1) per domain
+*                    point beyond the kernel window.
+*   info (struct):   The bandwidth and ('binned' only) details of the
+*                    approximation:
+*                       bw       - The bandwidth (e.g., as selected).
+*                       gridsize - The number of grid points.
+*                       eps      - The bound on the error of each kernel
+*                                  weight, relative to the kernel peak
+*                                  (for the CDF, of each kernel CDF).
+*                       errbound - Bound on the absolute error of 'yhat'
+*                                  at each point of 'd'.
+*   stats (struct):  Instrumentation of the call (e.g., for capacity
+*                    planning or production logs):
+*                       time     - Wall time (s) of each phase: 'clean'
+*                                  (converting the inputs and checking the
+*                                  weights), 'sort', 'bandwidth' (the
+*                                  selector), 'kernel', 'output', and their
+*                                  'total'.
+*                       threads  - The number of threads.
+*                       kernels  - The number of kernel weights (i.e., the
+*                                  sum of the window sizes).
+*                       winmean  - The mean number of data per window.
+*                       winmax   - The largest number of data in a window.
+*                       bytes    - The bytes of the working arrays (not
+*                                  including the outputs).
+*                    The binned approximation has no windows ('winmean'
+*                    and 'winmax' are NaN).
 *
 * EXCEPTIONS:
 *   1) Fewer than 3 arguments were passed.
 *   2) Empty array passed as an argument.
+*   3) Unrecognized or invalid optional name-value pair.
+*   4) 'x' or 'd' is not of class double, single, int16 or int32.
+*   5) 'weights' negative or infinite, or with a sum of 0.
+*   6) Greater than 4 values were returned.
+*   7) No (non-NaN) data within 'bounds' (or with a positive weight).
+*   8) 'error','se' with 'boundary','reflect' and 'method','binned'.
+*   9) 'dist','cdf' with 'bounds'.
+*  10) 'kernel','vonmises' with 'method','binned', 'bounds' or 'dist','cdf'.
+*  11) 'bw' is an unrecognized selector, or a selector with 'vonmises'.
+*  12) The data are too sparse (or have no spread) to select a bandwidth.
+*  13) A given 'bw' that is not positive and finite (for 'vonmises', a
+*      concentration of 0 is allowed).
 *
 * COMPILATION:
 *   Compile with following instructions in the MATLAB Commmand Window:
-*       mex kdee.c -output kdee
+*       MSVC:
+*           mex kdee.c -output kdee COMPFLAGS="$COMPFLAGS /openmp"
+*       GCC:
+*           mex kdee.c -output kdee CFLAGS="$CFLAGS -fopenmp"
+*       Clang:
+*           mex kdee.c -output kdee CFLAGS="$CFLAGS -fopenmp=libomp"
+*
+* DEPENDENCIES:
+*   OpenMP v2.0 or later (https://www.openmp.org/resources/openmp-compilers-tools/)
 *
 * AUTHOR:
 *   Devin H. Kehoe
@@ -35,25 +174,725 @@
 * HISTORY:
 *   author  date            task         
 *   dhk     aug 6, 2023     written
+*   dhk     oct 16, 2026    binned (linear binning + convolution) approximation
+*                           radix sort; skip sorting of already sorted data
+*                           single/int16/int32 inputs; single outputs
+*                           observation weights ('weights')
+*                           per-phase timing and counters ('stats' output)
+*                           adopted OpenMP; windowed errors; standard error
+*                           of the density ('error','se')
+*                           bounded densities ('bounds'), by truncation or
+*                           reflection ('boundary')
+*                           smoothed CDF ('dist','cdf')
+*                           von Mises kernel ('kernel','vonmises')
+*                           bandwidth selectors ('silverman', 'sj', 'lscv')
 **************************************************************************/
 
 #include "mex.h"
+#include <omp.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
 
 #define pi      3.14159265358979323846264338327950288419716939937510
 #define numBW   3
+#define cdfBW   9   // Half-width (in bandwidths) of the CDF window: Phi(-9) < 1e-18
+#define trigRestart 1024 // Steps of the angle-addition recurrence between direct cos()/sin()
+#define selGrid     8192 // Number of grid points of the bandwidth selectors
+#define selMax      1000 // Pairs more than sqrt(selMax) bandwidths apart are ignored by the selectors
+#define selScan     64   // Number of bandwidths scanned by least-squares cross-validation
+#define defaultGrid 4096    // Minimum number of grid points for the binned approximation
+#define maxGrid     (1<<22) // Maximum number of grid points for the binned approximation
+#define binRes      16      // Default number of grid points per bandwidth
+#define radixBits   11      // Number of bits sorted per pass of the radix sort
+#define radixSize   (1<<radixBits) // Number of buckets per pass of the radix sort
+#define radixMin    4096    // Smaller arrays are sorted with qsort()
+
+// Phases of a call, timed for the 'stats' output
+enum { PH_CLEAN, PH_SORT, PH_BANDWIDTH, PH_KERNEL, PH_OUTPUT, NUM_PHASES };
+static const char* phaseNames[NUM_PHASES] = { "clean", "sort", "bandwidth", "kernel", "output" };
+
+// Bandwidth selectors (a string passed as 'bw')
+enum { BW_GIVEN, BW_SILVERMAN, BW_SJ, BW_LSCV };
 
 /**************************************************************************
 *                                FUNCTIONS                                *
 **************************************************************************/
+// A datum and its weight (sorted by comp(), which compares the datum)
+typedef struct wpair
+{
+    double x, w;
+} wpair;
+
+// NaNs are sorted last (otherwise they compare equal to every value, which
+// leaves the rest of the array unsorted)
 int comp(const void* ia, const void* ib)
 {
     double a = *(double*)ia;
     double b = *(double*)ib;
+    if (isnan(a) || isnan(b))
+        return isnan(a) - isnan(b);
     return (a > b) - (a < b);
 }
 
+// Map a double onto an unsigned integer with the same ordering, by flipping
+// the sign bit of positive values and all bits of negative values. NaNs
+// (of either sign) are sorted last, as by comp().
+uint64_t sortKey(double v)
+{
+    uint64_t u;
+    if (isnan(v))
+        return UINT64_MAX;
+    memcpy(&u, &v, sizeof(u));
+    return (u >> 63) ? ~u : u ^ 0x8000000000000000ULL;
+}
+
+// Inverse of sortKey()
+double fromKey(uint64_t u)
+{
+    double v;
+    u = (u >> 63) ? u ^ 0x8000000000000000ULL : ~u;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// Sort 'x' in place, along with the weights 'w' (if not NULL). Data that is
+// already sorted is detected in O(n) (any NaN counts as unsorted, as it
+// compares false with its neighbours); small arrays use qsort(); everything
+// else is LSD radix sorted on the IEEE-754 bit pattern, radixBits bits per
+// pass, skipping passes in which every key shares the same digit.
+void sort(double x[], double w[], size_t n)
+{
+    size_t i, d, p;
+    for (i = 0; i<n; i++)
+        if (isnan(x[i]) || (i > 0 && x[i] < x[i-1]))
+            break;
+    if (i >= n) // Already sorted
+        return;
+    if (n < radixMin && w == NULL) {
+        qsort(x, n, sizeof(double), comp);
+        return;
+    }
+    if (n < radixMin) {
+        wpair* xw = malloc(n * sizeof(wpair));
+        for (i = 0; i<n; i++)
+            xw[i].x = x[i], xw[i].w = w[i];
+        qsort(xw, n, sizeof(wpair), comp);
+        for (i = 0; i<n; i++)
+            x[i] = xw[i].x, w[i] = xw[i].w;
+        free(xw);
+        return;
+    }
+
+    uint64_t *key[2] = { malloc(n * sizeof(uint64_t)), malloc(n * sizeof(uint64_t)) };
+    double *wt[2] = { w, w == NULL ? NULL : malloc(n * sizeof(double)) }; // Weights follow their keys
+    size_t* off = malloc(radixSize * sizeof(size_t)), o;
+    int shift, s = 0;
+    for (i = 0; i<n; i++)
+        key[0][i] = sortKey(x[i]);
+
+    for (shift = 0; shift<64; shift += radixBits)
+    {
+        // Histogram this digit
+        for (d = 0; d<radixSize; d++)
+            off[d] = 0;
+        for (i = 0; i<n; i++)
+            off[(key[s][i] >> shift) & (radixSize-1)]++;
+        if (off[(key[s][0] >> shift) & (radixSize-1)] == n) // Every key in the same bucket
+            continue;
+
+        // Convert to bucket offsets, then scatter
+        for (p = 0, d = 0; d<radixSize; d++) {
+            i = off[d];
+            off[d] = p;
+            p += i;
+        }
+        for (i = 0; i<n; i++) {
+            o = off[(key[s][i] >> shift) & (radixSize-1)]++;
+            key[1-s][o] = key[s][i];
+            if (w != NULL)
+                wt[1-s][o] = wt[s][i];
+        }
+        s = 1-s;
+    }
+
+    for (i = 0; i<n; i++)
+        x[i] = fromKey(key[s][i]);
+    if (w != NULL && s)
+        memcpy(w, wt[1], n * sizeof(double));
+    free(key[0]);
+    free(key[1]);
+    free(wt[1]);
+    free(off);
+}
+
+// First index i in [lo,hi) of the sorted array 'xs' such that xs[i] >= v
+// (or hi, if there is none)
+size_t lowerBound(const double xs[], size_t lo, size_t hi, double v)
+{
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (xs[mid] < v)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// First index i in [lo,hi) of the sorted array 'xs' such that xs[i] > v
+// (or hi, if there is none)
+size_t upperBound(const double xs[], size_t lo, size_t hi, double v)
+{
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (xs[mid] <= v)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Galloping search: first index i >= start of the sorted array 'xs' such
+// that xs[i] >= v. Costs O(log(i-start)), so it is cheap when successive
+// searches are close together.
+size_t gallop(const double xs[], size_t start, size_t m, double v)
+{
+    if (start >= m || xs[start] >= v)
+        return start;
+    size_t lo = start, hi, step = 1; // Invariant: xs[lo] < v
+    while (1) {
+        hi = lo+step;
+        if (hi >= m) {
+            hi = m;
+            break;
+        }
+        if (xs[hi] >= v)
+            break;
+        lo = hi;
+        step *= 2;
+    }
+    return lowerBound(xs, lo+1, hi, v);
+}
+
+// Is 'v' within the bounds [bounds[0], bounds[1]] (or are there none)?
+// NaNs are never within them, so they are excluded like any other datum
+// outside of the bounds.
+bool inBounds(double v, const double bounds[])
+{
+    return !isnan(v) && (bounds == NULL || (bounds[0] <= v && v <= bounds[1]));
+}
+
+// (Weighted) mean and variance (normalized by the sum of the weights 'W')
+// of the data, in two passes. The RMS deviation of the data from a value
+// 'f' is then sqrt( var + (mean-f)^2 ), without a pass through the data.
+// Data outside of 'bounds' (if not NULL) are skipped.
+void moments(const double x[], const double w[], size_t m, double W, const double bounds[], double* mean, double* var)
+{
+    double s = 0, d;
+    size_t i;
+    for (i = 0; i<m; i++)
+        if (inBounds(x[i], bounds))
+            s += (w == NULL ? 1 : w[i]) * x[i];
+    *mean = s / W;
+    for (s = 0, i = 0; i<m; i++) {
+        if (!inBounds(x[i], bounds))
+            continue;
+        d = x[i] - *mean;
+        s += (w == NULL ? 1 : w[i]) * d*d;
+    }
+    *var = s / W;
+}
+
+// Standard error of a density estimate f = sum( w_j*K_j )/W, where K_j is
+// the (normalized) kernel of datum j, given k2 = sum( w_j*K_j^2 )/W. The
+// terms K_j are a weighted sample with mean f and effective size
+// Weff = W^2/sum(w_j^2), so f has the variance of the terms divided by
+// Weff (which does not depend on the scale of the weights). Only the data
+// in the kernel window contribute to either sum.
+double kernelSE(double k2, double f, double Weff)
+{
+    double v = (k2 - f*f) / Weff;
+    return v > 0 ? sqrt(v) : 0;
+}
+
+// Normalization of a bounded density estimate at 'mu': the mass of the
+// Gaussian kernel centred on 'mu' that lies within the bounds, which the
+// truncated estimate is divided by. Reflection folds that mass back within
+// the bounds, so it needs no normalization (1). Either is 0 outside the
+// bounds. Costs two erf() per domain point.
+double boundMass(double mu, double bw, const double bounds[], bool reflect)
+{
+    if (bounds == NULL)
+        return 1;
+    if (!inBounds(mu, bounds))
+        return 0;
+    if (reflect)
+        return 1;
+    return ( erf( (bounds[1]-mu) / (bw*sqrt(2.0)) ) - erf( (bounds[0]-mu) / (bw*sqrt(2.0)) ) ) / 2;
+}
+
+// Exponentially scaled modified Bessel function of the first kind of order
+// 0, I0(k)*exp(-k), for k >= 0 (the normalization of the von Mises kernel).
+// The power series is used for small k, otherwise the asymptotic expansion,
+// which does not overflow.
+double besselI0e(double k)
+{
+    double s = 1, t = 1, q = k*k/4;
+    int j;
+    if (k < 30) {
+        for (j = 1; t > 1e-17*s; j++) {
+            t *= q / ((double)j*j);
+            s += t;
+        }
+        return s * exp(-k);
+    }
+    for (j = 1; j<30; j++) {
+        t *= (2.0*j-1)*(2.0*j-1) / (8.0*j*k);
+        s += t;
+    }
+    return s / sqrt(2*pi*k);
+}
+
+// Angle 'a' wrapped onto [-pi, pi)
+double wrapAngle(double a)
+{
+    return a - 2*pi*floor( (a+pi) / (2*pi) );
+}
+
+// Case-insensitive comparison of option names
+bool isOption(const char* a, const char* b)
+{
+    for (; *a && *b; a++, b++)
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+            return false;
+    return *a == *b;
+}
+
+// Is 'a' a real array of a supported class (double, single, int16, int32)?
+bool isSupported(const mxArray* a)
+{
+    mxClassID cls = mxGetClassID(a);
+    return !mxIsComplex(a) && (cls == mxDOUBLE_CLASS || cls == mxSINGLE_CLASS ||
+                               cls == mxINT16_CLASS  || cls == mxINT32_CLASS);
+}
+
+// The data of 'a' as doubles. Arrays of class double are not copied;
+// otherwise a converted copy is returned, which the caller must free().
+double* asDouble(const mxArray* a)
+{
+    if (mxIsDouble(a))
+        return mxGetPr(a);
+    size_t n = mxGetNumberOfElements(a);
+    if (!n)
+        return NULL;
+    double* d = malloc(n * sizeof(double));
+    const void* data = mxGetData(a);
+    for (size_t i = 0; i<n; i++)
+        switch (mxGetClassID(a)) {
+            case mxSINGLE_CLASS: d[i] = ((const float*)data)[i];   break;
+            case mxINT16_CLASS:  d[i] = ((const int16_t*)data)[i]; break;
+            default:             d[i] = ((const int32_t*)data)[i]; break;
+        }
+    return d;
+}
+
+// End the current phase (which started at 't0'), and add its wall time to
+// phase 'p'
+void endPhase(double time[], int p, double* t0)
+{
+    double t = omp_get_wtime();
+    time[p] += t - *t0;
+    *t0 = t;
+}
+
+// The 'stats' output: the wall time of each phase (and their total), and the
+// counters of the call (see the header)
+mxArray* statsStruct(const double time[], double kernels, double windows, double winmax, double bytes)
+{
+    mxArray *s = mxCreateStructMatrix(1, 1, 0, NULL), *t = mxCreateStructMatrix(1, 1, 0, NULL);
+    const char* fields[] = { "time", "threads", "kernels", "winmean", "winmax", "bytes" };
+    double total = 0;
+    for (int p = 0; p<NUM_PHASES; p++) {
+        mxAddField(t, phaseNames[p]);
+        mxSetField(t, 0, phaseNames[p], mxCreateDoubleScalar(time[p]));
+        total += time[p];
+    }
+    mxAddField(t, "total");
+    mxSetField(t, 0, "total", mxCreateDoubleScalar(total));
+    mxArray* v[] = { t, mxCreateDoubleScalar((double)omp_get_max_threads()), mxCreateDoubleScalar(kernels),
+                     mxCreateDoubleScalar(windows > 0 ? kernels / windows : NAN),
+                     mxCreateDoubleScalar(windows > 0 ? winmax : NAN), mxCreateDoubleScalar(bytes) };
+    for (int f = 0; f<6; f++) {
+        mxAddField(s, fields[f]);
+        mxSetField(s, 0, fields[f], v[f]);
+    }
+    return s;
+}
+
+// Copy 'v' into the single precision output 'a' and free it
+void toSingle(mxArray* a, double v[], size_t n)
+{
+    float* f = mxGetData(a);
+    for (size_t i = 0; i<n; i++)
+        f[i] = (float)v[i];
+    free(v);
+}
+
+// Sum of binned counts at grid offsets [-hi,-lo] and [lo,hi] around grid
+// point g (or [-hi,hi] when lo is 0), from the (G+1) prefix sums 'P'
+double boxSum(const double P[], size_t G, size_t g, size_t lo, size_t hi)
+{
+    size_t a = g < hi ? 0 : g-hi,       // Left segment [a, b)
+           b = g+1 < lo ? 0 : g+1-lo,
+           d = g+hi+1 < G ? g+hi+1 : G, // Right segment [e, d)
+           e = g+lo < G ? g+lo : G;
+    if (!lo)
+        return P[d] - P[a];
+    return (b > a ? P[b] - P[a] : 0) + (d > e ? P[d] - P[e] : 0);
+}
+
+// Binned approximation of the KDE:
+//   1) Linearly bin the (unsorted) data onto a grid of G equally spaced points
+//   2) Convolve the bin counts with the kernel, truncated at +/- numBW
+//      bandwidths (L grid points)
+//   3) Linearly interpolate onto the domain
+// Each datum's kernel weight is linearly interpolated twice (onto the grid,
+// then onto the domain), which each contribute at most
+// (delta^2/8)*max|K''| = delta^2/(8*bw^2) relative to the kernel peak. Data
+// within a few grid points of the truncation may be included by one method
+// and excluded by the other; their weight is at most 'kcut'. Returns the
+// former bound; 'ebound' (if not NULL) receives the bound on each 'yhat'.
+// Each datum is binned with its weight in 'w' (1 if NULL), whose sum is 'W'.
+// If 'se' is not NULL, the bin counts are also convolved with the squared
+// kernel, which gives the standard error of 'yhat' (see kernelSE()).
+// If 'bounds' is not NULL, data outside of them are not binned ('W' is the
+// sum of the weights within them), and the estimate is either renormalized
+// by boundMass() or, if 'reflect', is the sum of the convolution at 'd' and
+// at its reflections about the bounds (the grid is extended by the kernel
+// half-width, so that the reflections of 'd' are on the grid). The standard
+// error of the reflected estimate is not available.
+// If '*G' is 0, it receives the default number of grid points, binRes per
+// bandwidth over the span of the grid (within [defaultGrid, maxGrid]).
+// If 'cdf', the bin counts are instead convolved with the kernel CDF, over
+// +/- cdfBW bandwidths, plus the prefix sum of the bins below (whose kernel
+// CDFs are 1). Interpolating the kernel CDF contributes at most
+// (delta^2/8)*max|Phi''| = delta^2/(8*bw^2)*phi(1) twice, and the bins
+// beyond the window contribute at most Phi(-cdfBW), which is negligible.
+double binnedKDE(const double x[], const double w[], size_t m, double W, const double mu[], size_t n, double bw, size_t* Gp,
+                 const double bounds[], bool reflect, bool cdf, double yhat[], double ebound[], double se[])
+{
+    // Grid spans both the data (within the bounds) and the domain
+    double lo = mu[0], hi = mu[0];
+    for (size_t i = 0; i<m; i++) {
+        if (!inBounds(x[i], bounds))
+            continue;
+        lo = x[i] < lo ? x[i] : lo;
+        hi = hi < x[i] ? x[i] : hi;
+    }
+    for (size_t i = 0; i<n; i++) {
+        lo = mu[i] < lo ? mu[i] : lo;
+        hi = hi < mu[i] ? mu[i] : hi;
+    }
+    if (reflect) {
+        lo -= numBW*bw;
+        hi += numBW*bw;
+    }
+    if (!*Gp) { // By default, the grid spacing is at most 1/binRes of a bandwidth
+        double gs = ceil((hi-lo)/bw*binRes)+1; // (clamped before the cast)
+        *Gp = gs < defaultGrid ? defaultGrid : (maxGrid < gs ? maxGrid : (size_t)gs);
+    }
+    size_t G = *Gp;
+    double delta = hi > lo ? (hi-lo)/(double)(G-1) : bw,
+           hw = ceil((cdf ? cdfBW : numBW)*bw/delta); // Kernel half-width in grid points
+    size_t L = hw < (double)G ? (size_t)hw : G-1; // (clamped before the cast)
+
+    // STEP 1: Linear binning
+    double* S = calloc(G, sizeof(double));
+    double p, f, v, W2 = 0; // Sum of the squared weights
+    size_t l, g;
+    for (size_t i = 0; i<m; i++)
+    {
+        if (!inBounds(x[i], bounds))
+            continue;
+        p = (x[i]-lo)/delta;
+        l = (size_t)p;
+        if (G-2 < l)
+            l = G-2;
+        f = p-(double)l; // Fraction of the datum assigned to bin l+1
+        v = w == NULL ? 1 : w[i];
+        S[l] += (1-f)*v;
+        S[l+1] += f*v;
+        W2 += v*v;
+    }
+
+    // STEP 2: Truncated convolution with the kernel
+    double norm = bw * sqrt(2*pi) * W;
+    double* kern = malloc((2*L+1) * sizeof(double)); // PDF: offsets [0, L]; CDF: offsets [-L, L]
+    for (g = 0; !cdf && g<=L; g++)
+        kern[g] = exp( -pow((double)g*delta,2) / (2*bw*bw) ) / norm;
+    for (g = 0; cdf && g<=2*L; g++)
+        kern[g] = erfc( ((double)L-(double)g)*delta / (bw*sqrt(2.0)) ) / 2 / W;
+
+    // Prefix sums of the bin counts (for the truncation band, and the bins
+    // below the window of the CDF)
+    double* P = malloc((G+1) * sizeof(double));
+    for (P[0] = 0, g = 0; g<G; g++)
+        P[g+1] = P[g] + S[g];
+
+    double* T  = calloc(G, sizeof(double));
+    double* T2 = se == NULL ? NULL : calloc(G, sizeof(double)); // Convolution with the squared kernel
+    long long int gg; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+    #pragma omp parallel for schedule(static) private(l)
+    for (gg = 0; gg<(long long int)G; gg++)
+    {
+        size_t c = (size_t)gg, k;
+        if (cdf && L < c) { // Bins below the window
+            T[c] = P[c-L] / W;
+            if (T2 != NULL)
+                T2[c] = P[c-L] / W / W;
+        }
+        for (l = c < L ? 0 : c-L; l<=c+L && l<G; l++) {
+            k = cdf ? c+L-l : (l < c ? c-l : l-c);
+            T[c] += kern[k] * S[l];
+            if (T2 != NULL)
+                T2[c] += kern[k] * kern[k] * S[l];
+        }
+    }
+
+    // STEP 3: Interpolate onto the domain
+    double eps = delta*delta / (4*bw*bw) * (cdf ? exp(-0.5) / sqrt(2*pi) : 1),
+          kcut = L > 4 ? exp( -pow((L-4)*delta,2) / (2*bw*bw) ) : 1;
+    size_t inner = L > 3 ? L-3 : 0, outer = L+3; // Grid offsets of the truncation band
+    double c[3], z, t2, eb; // Points at which the convolution is summed; Normalization
+    int r, nc;
+    for (size_t i = 0; i<n; i++)
+    {
+        // The domain point, and its reflections within reach of the kernel
+        c[0] = mu[i], nc = 1;
+        if (reflect && mu[i]-bounds[0] < numBW*bw)
+            c[nc++] = 2*bounds[0]-mu[i];
+        if (reflect && bounds[1]-mu[i] < numBW*bw)
+            c[nc++] = 2*bounds[1]-mu[i];
+
+        yhat[i] = 0, t2 = 0, eb = 0;
+        for (r = 0; r<nc; r++)
+        {
+            p = (c[r]-lo)/delta;
+            if (r && (p < 0 || (double)(G-1) < p)) // No data within reach
+                continue;
+            l = (size_t)p;
+            if (G-2 < l)
+                l = G-2;
+            f = p-(double)l;
+            yhat[i] += (1-f)*T[l] + f*T[l+1];
+            if (se != NULL)
+                t2 += (1-f)*T2[l] + f*T2[l+1];
+            if (ebound != NULL)
+                eb += cdf ? eps : eps / (bw * sqrt(2*pi)) + kcut / norm *
+                    ( (1-f)*boxSum(P, G, l, inner, outer) + f*boxSum(P, G, l+1, inner, outer) );
+        }
+
+        z = boundMass(mu[i], bw, bounds, reflect);
+        if (se != NULL)
+            se[i] = z > 0 ? kernelSE(W * t2, yhat[i], W*W / W2) / z : 0;
+        if (ebound != NULL)
+            ebound[i] = z > 0 ? eb / z : 0;
+        yhat[i] = z > 0 ? yhat[i] / z : 0;
+    }
+
+    free(S);
+    free(kern);
+    free(T);
+    free(T2);
+    free(P);
+
+    return eps;
+}
+
+// Sum over all pairs of the binned data of a function of their distance in
+// bandwidths, z = k*delta/h, where A[k] is the (weighted) number of pairs k
+// grid points apart (each pair at k > 0 is counted twice). The function is
+// He_r(z)*exp(-z^2/2), the r_th derivative of the normal density (up to
+// 1/sqrt(2*pi)), for r = 4 or 6, or exp(-z^2/4) - sqrt(8)*exp(-z^2/2), the
+// pair term of least-squares cross-validation, for r = 0.
+double pairSum(const double A[], size_t G, double delta, double h, int r)
+{
+    double s = 0, z, t;
+    for (size_t k = 0; k<G; k++) {
+        z = (double)k*delta/h;
+        z *= z; // squared
+        if (z >= selMax)
+            break;
+        t = r == 4 ? exp(-z/2) * (z*z - 6*z + 3)
+          : r == 6 ? exp(-z/2) * (z*z*z - 15*z*z + 45*z - 15)
+          :          exp(-z/4) - sqrt(8.0)*exp(-z/2);
+        s += (k ? 2 : 1) * A[k] * t;
+    }
+    return s;
+}
+
+// Binned estimate of the density functional psi_r = E[f^(r)(X)] (r = 4, 6)
+// with a Gaussian kernel of bandwidth 'h'
+double psi(const double A[], size_t G, double delta, double W, double h, int r)
+{
+    return pairSum(A, G, delta, h, r) / (W*W * pow(h, r+1) * sqrt(2*pi));
+}
+
+// Binned least-squares cross-validation score of the bandwidth 'h': the
+// integrated squared error of the estimate, up to a constant, as in R's
+// bw.ucv(), (0.5 + sum_{i<j} t(z_ij)/W) / (W*h*sqrt(pi)). The W pairs of
+// each (repeated) datum with itself are removed from the pair sum, which
+// then counts every other pair twice.
+double lscv(const double A[], size_t G, double delta, double W, double h)
+{
+    return ( 0.5 + (pairSum(A, G, delta, h, 0) - W*(1-sqrt(8.0))) / (2*W) ) / (W * h * sqrt(pi));
+}
+
+// The Sheather-Jones equation, whose root in 'h' is the selected bandwidth
+double sjEquation(const double A[], size_t G, double delta, double W, double alpha, double h)
+{
+    return pow( 1 / (2*sqrt(pi)*W*psi(A, G, delta, W, alpha*pow(h, 5.0/7), 4)), 0.2 ) - h;
+}
+
+// Select the bandwidth of the (Gaussian) KDE of the data within 'bounds' (if
+// not NULL), whose weights sum to 'W'. The weights are rescaled to sum to
+// their effective sample size, sum(w)^2/sum(w.^2) (m for equal weights),
+// which then stands for W below, so that the selection does not depend on
+// the scale of the weights; 'sd' is the unbiased weighted std:
+//   BW_SILVERMAN - Silverman's rule (as in kde.m),
+//                  0.9*min( sd, IQR/1.34 )*W^(-1/5)
+//   BW_SJ        - Sheather-Jones solve-the-equation plug-in: the root of
+//                  h = ( 1/(2*sqrt(pi)*W*psi4(g(h))) )^(1/5), where the
+//                  pilot bandwidth g(h) = 1.357*(psi4(a)/-psi6(b))^(1/7)*h^(5/7)
+//                  uses normal reference pilots 'a' and 'b'
+//   BW_LSCV      - The minimum of the least-squares cross-validation score
+// The selectors search [0.1, 1]*hmax (hmax = 1.144*sd*W^(-1/5); SJ widens
+// it until the root is bracketed) as in R's bw.SJ() and bw.ucv(). The data
+// are linearly binned onto selGrid points, and the (weighted) numbers of
+// pairs at each grid distance are counted once, in O(selGrid^2), so each
+// functional costs O(selGrid) and the O(m) binning dominates. The quartiles
+// are interpolated from the bin counts. Returns NaN if the data are too
+// sparse (or have no spread).
+double selectBandwidth(const double x[], const double w[], size_t m, double W, const double bounds[], int selector)
+{
+    // STEP 1: Linear binning of the data within the bounds
+    double lo = INFINITY, hi = -INFINITY;
+    size_t G = selGrid, i, l;
+    for (i = 0; i<m; i++)
+        if (inBounds(x[i], bounds)) {
+            lo = x[i] < lo ? x[i] : lo;
+            hi = hi < x[i] ? x[i] : hi;
+        }
+    if (!(lo < hi))
+        return NAN;
+    double W2 = 0, c; // Sum of the squared weights; Scale of the weights
+    for (i = 0; w != NULL && i<m; i++)
+        W2 += inBounds(x[i], bounds) ? w[i]*w[i] : 0;
+    double Weff = w == NULL ? W : W*W / W2;
+    c = Weff / W;
+    double delta = (hi-lo) / (double)(G-1), p, f, v;
+    double* S = calloc(G, sizeof(double));
+    for (i = 0; i<m; i++)
+    {
+        if (!inBounds(x[i], bounds))
+            continue;
+        p = (x[i]-lo)/delta;
+        l = (size_t)p;
+        if (G-2 < l)
+            l = G-2;
+        f = p-(double)l;
+        v = w == NULL ? 1 : c*w[i];
+        S[l] += (1-f)*v;
+        S[l+1] += f*v;
+    }
+
+    // STEP 2: Scale of the data
+    double mean, var, q[2], sd, scale; // Quartiles
+    moments(x, w, m, W, bounds, &mean, &var);
+    W = Weff;
+    if (!(W > 1))
+        return NAN;
+    sd = sqrt(var * W / (W-1));
+    c = 0; // Mass below grid point l
+    l = 0;
+    for (int j = 0; j<2; j++) { // Quartiles, interpolated between the grid points
+        for (p = (j ? 0.75 : 0.25) * W; l<G-1 && c + S[l] < p; l++)
+            c += S[l];
+        q[j] = lo + delta * ((double)l - (S[l] > 0 ? (c + S[l] - p) / S[l] : 0));
+    }
+    if (selector == BW_SILVERMAN) {
+        free(S);
+        scale = q[1]-q[0] > 0 && (q[1]-q[0])/1.34 < sd ? (q[1]-q[0])/1.34 : sd;
+        return scale > 0 ? 0.9 * scale * pow(W, -0.2) : NAN;
+    }
+    scale = q[1]-q[0] > 0 && (q[1]-q[0])/1.349 < sd ? (q[1]-q[0])/1.349 : sd;
+
+    // STEP 3: Number of pairs at each grid distance
+    double* A = calloc(G, sizeof(double));
+    long long int kk; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+    #pragma omp parallel for schedule(dynamic,64) private(l)
+    for (kk = 0; kk<(long long int)G; kk++)
+        for (l = 0; l+(size_t)kk<G; l++)
+            A[kk] += S[l] * S[l+(size_t)kk];
+    free(S);
+
+    // STEP 4: Solve (SJ) or minimize (LSCV) over the bandwidth
+    double hmax = 1.144 * sd * pow(W, -0.2), a = 0.1*hmax, b = hmax, h = NAN;
+    if (selector == BW_SJ && scale > 0) {
+        double TD = -psi(A, G, delta, W, 1.23*scale*pow(W, -1.0/9), 6),
+               SD =  psi(A, G, delta, W, 1.24*scale*pow(W, -1.0/7), 4),
+            alpha = 1.357 * pow(SD/TD, 1.0/7),
+               fa = sjEquation(A, G, delta, W, alpha, a), fh = sjEquation(A, G, delta, W, alpha, b);
+        for (int j = 0; TD > 0 && SD > 0 && fa*fh > 0 && j<99; j++) { // Widen the interval
+            if (j % 2)
+                a /= 1.2, fa = sjEquation(A, G, delta, W, alpha, a);
+            else
+                b *= 1.2, fh = sjEquation(A, G, delta, W, alpha, b);
+        }
+        if (TD > 0 && SD > 0 && fa*fh <= 0) {
+            while (b-a > 1e-8*b) { // Bisection
+                h = (a+b)/2;
+                fh = sjEquation(A, G, delta, W, alpha, h);
+                if (fa*fh > 0)
+                    a = h, fa = fh;
+                else
+                    b = h;
+            }
+            h = (a+b)/2;
+        }
+    }
+    else if (selector == BW_LSCV && sd > 0) {
+        // Scan log-spaced bandwidths (the score may have several local
+        // minima), then refine the best by golden-section search
+        double best = INFINITY, u, r = (sqrt(5.0)-1)/2, h1, h2, u1, u2;
+        int j, k = 0;
+        for (j = 0; j<selScan; j++) {
+            u = lscv(A, G, delta, W, a*pow(b/a, (double)j/(selScan-1)));
+            if (u < best)
+                best = u, k = j;
+        }
+        a = 0.1*hmax * pow(10, (double)(k ? k-1 : 0)/(selScan-1));
+        b = 0.1*hmax * pow(10, (double)(k < selScan-1 ? k+1 : k)/(selScan-1));
+        h1 = b - r*(b-a), u1 = lscv(A, G, delta, W, h1);
+        h2 = a + r*(b-a), u2 = lscv(A, G, delta, W, h2);
+        while (b-a > 1e-8*b) {
+            if (u1 < u2)
+                b = h2, h2 = h1, u2 = u1, h1 = b - r*(b-a), u1 = lscv(A, G, delta, W, h1);
+            else
+                a = h1, h1 = h2, u1 = u2, h2 = a + r*(b-a), u2 = lscv(A, G, delta, W, h2);
+        }
+        h = (a+b)/2;
+    }
+    free(A);
+    return h > 0 ? h : NAN;
+}
+
 /**************************************************************************
 *                                   MEX                                   *
 **************************************************************************/
@@ -62,95 +901,440 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     ////////////////////////////////
     // SET UP
 
-    // Check number of inputs
+    double t0 = omp_get_wtime(), time[NUM_PHASES] = { 0 }, bytes = 0; // Start of the current phase; Wall time of each phase; Bytes of the working arrays
+
+    // Check number of inputs and outputs
+    if (nlhs>4)
+        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 4 outputs.");
     if (nrhs<3)
         mexErrMsgIdAndTxt("kreg:inputError","Three inputs required: kreg(x, domain, bw)");
 
     // Inputs
-    double*  x = mxGetPr(prhs[0]); // arg 0 --> x
-    double* mu = mxGetPr(prhs[1]); // arg 2 --> domain
+    if (!isSupported(prhs[0]) || !isSupported(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Arguments 'x' and 'd' must be of class double, single, int16, or int32.");
 
         // Ensure arrays are filled
-    if (x == NULL)
+    if (mxIsEmpty(prhs[0]))
         mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'x'");
-    if (mu == NULL)
+    if (mxIsEmpty(prhs[1]))
         mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'd'");
-    if (mxGetPr(plhs[2]) == NULL)
+    if (!mxIsChar(prhs[2]) && mxGetPr(prhs[2]) == NULL)
         mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'bw'");
 
+    // 'bw' may name a bandwidth selector
+    int selector = BW_GIVEN;
+    if (mxIsChar(prhs[2])) {
+        char* name = mxArrayToString(prhs[2]);
+        selector = name == NULL ? -1 : isOption(name,"silverman") ? BW_SILVERMAN :
+                   isOption(name,"sj") ? BW_SJ : isOption(name,"lscv") ? BW_LSCV : -1;
+        mxFree(name);
+        if (selector < 0)
+            mexErrMsgIdAndTxt("kreg:inputError","Argument 'bw' must be numeric, or one of 'silverman', 'sj' or 'lscv'.");
+    }
+
+    // Optional name-value pairs
+    if ((nrhs-3) % 2)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional arguments must be given as name-value pairs.");
+    bool binned = false; // Use the binned approximation?
+    size_t G = 0;        // Number of grid points for the binned approximation (0 --> default)
+    bool single = false; // Return single precision outputs?
+    const mxArray* weights = NULL; // Observation weights of 'x'
+    bool se = false;     // Is 'ehat' the standard error (or the RMS deviation)?
+    double bounds[2];    // Bounds of the support of the density
+    bool bounded = false, reflect = false; // Bounded? Reflected (or truncated)?
+    bool cdf = false;    // Estimate the CDF (or the PDF)?
+    bool vonMises = false; // Circular (von Mises) kernel (or Gaussian)?
+    for (int a = 3; a<nrhs; a += 2)
+    {
+        char* name = mxArrayToString(prhs[a]);
+        char* mode = mxIsChar(prhs[a+1]) ? mxArrayToString(prhs[a+1]) : NULL;
+        bool ok = name != NULL;
+        if (ok && isOption(name,"method")) {
+            binned = mode != NULL && isOption(mode,"binned");
+            ok = binned || (mode != NULL && isOption(mode,"exact"));
+        }
+        else if (ok && isOption(name,"gridsize")) {
+            double gs = mxGetScalar(prhs[a+1]);
+            ok = mxIsEmpty(prhs[a+1]) || (2 <= gs && !isinf(gs));
+            G = mxIsEmpty(prhs[a+1]) ? 0 : (size_t)gs;
+        }
+        else if (ok && isOption(name,"output")) {
+            single = mode != NULL && isOption(mode,"single");
+            ok = single || (mode != NULL && isOption(mode,"double"));
+        }
+        else if (ok && isOption(name,"error")) {
+            se = mode != NULL && isOption(mode,"se");
+            ok = se || (mode != NULL && isOption(mode,"rms"));
+        }
+        else if (ok && isOption(name,"bounds")) {
+            bounded = !mxIsEmpty(prhs[a+1]);
+            ok = !bounded || (isSupported(prhs[a+1]) && mxGetNumberOfElements(prhs[a+1]) == 2);
+            if (ok && bounded) {
+                double* b = asDouble(prhs[a+1]);
+                bounds[0] = b[0], bounds[1] = b[1];
+                if (!mxIsDouble(prhs[a+1]))
+                    free(b);
+                ok = bounds[0] < bounds[1]; // Not NaN
+            }
+        }
+        else if (ok && isOption(name,"dist")) {
+            cdf = mode != NULL && isOption(mode,"cdf");
+            ok = cdf || (mode != NULL && isOption(mode,"pdf"));
+        }
+        else if (ok && isOption(name,"kernel")) {
+            vonMises = mode != NULL && isOption(mode,"vonmises");
+            ok = vonMises || (mode != NULL && isOption(mode,"gauss"));
+        }
+        else if (ok && isOption(name,"boundary")) {
+            reflect = mode != NULL && isOption(mode,"reflect");
+            ok = reflect || (mode != NULL && isOption(mode,"truncate"));
+        }
+        else if (ok && isOption(name,"weights")) {
+            weights = mxIsEmpty(prhs[a+1]) ? NULL : prhs[a+1];
+            ok = weights == NULL || (isSupported(weights) && mxGetNumberOfElements(weights) == mxGetNumberOfElements(prhs[0]));
+        }
+        else
+            ok = false;
+        mxFree(mode);
+        mxFree(name);
+        if (!ok)
+            mexErrMsgIdAndTxt("kreg:inputError","Invalid optional argument %d.",a+1);
+    }
+    reflect = reflect && bounded;
+    if (reflect && binned && se && nlhs>=2)
+        mexErrMsgIdAndTxt("kreg:inputError","The standard error of a reflected density requires 'method','exact'.");
+    if (cdf && bounded)
+        mexErrMsgIdAndTxt("kreg:inputError","'dist','cdf' is not available with 'bounds'.");
+    if (vonMises && (binned || bounded || cdf))
+        mexErrMsgIdAndTxt("kreg:inputError","The 'vonmises' kernel is not available with 'method','binned', 'bounds' or 'dist','cdf'.");
+    if (vonMises && selector != BW_GIVEN)
+        mexErrMsgIdAndTxt("kreg:inputError","The bandwidth selectors are not available for the 'vonmises' kernel.");
+
+    // Data of class single, int16 or int32 are converted here
+    double*  x = asDouble(prhs[0]); // arg 0 --> x
+    double* mu = asDouble(prhs[1]); // arg 2 --> domain
+    bool xcopy = !mxIsDouble(prhs[0]), mcopy = !mxIsDouble(prhs[1]); // Were they converted?
+
     // Size variables
     size_t m = mxGetNumberOfElements(prhs[0]); // number of x data
     size_t n = mxGetNumberOfElements(prhs[1]); // number of domain points
 
+    // Observation weights (copied, since they are sorted with 'x'). A NaN
+    // weight excludes its datum, as a weight of 0 does.
+    double* w = NULL, W = (double)m; // Weights; Sum of weights
+    if (weights != NULL) {
+        double* wd = asDouble(weights);
+        w = malloc(m * sizeof(double));
+        W = 0;
+        for (size_t i = 0; i<m; i++) {
+            w[i] = isnan(wd[i]) ? 0 : wd[i];
+            W += w[i];
+            if (!(0 <= w[i]) || isinf(w[i]))
+                W = NAN;
+        }
+        if (!mxIsDouble(weights))
+            free(wd);
+        if (!(W > 0)) {
+            free(w);
+            if (xcopy)
+                free(x);
+            if (mcopy)
+                free(mu);
+            mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'weights' must be non-negative and finite (or NaN), with a positive sum.");
+        }
+    }
+
+    // Only the (non-NaN) data within the bounds contribute to the density
+    double W2 = 0; // Sum of the squared weights
+    W = 0;
+    for (size_t i = 0; i<m; i++)
+        if (inBounds(x[i], bounded ? bounds : NULL)) {
+            W += w == NULL ? 1 : w[i];
+            W2 += w == NULL ? 1 : w[i]*w[i];
+        }
+    if (!(W > 0)) {
+        free(w);
+        if (xcopy)
+            free(x);
+        if (mcopy)
+            free(mu);
+        mexErrMsgIdAndTxt("kreg:inputError","No (non-NaN) data within 'bounds' (or with a positive weight).");
+    }
+
+    bytes += (double)(xcopy*m + mcopy*n + (w != NULL)*m) * sizeof(double);
+    endPhase(time, PH_CLEAN, &t0);
+
     // Constants
-    double bw = mxGetScalar(prhs[2]); // arg 3 --> bandwidth
+    double bw = selector == BW_GIVEN ? mxGetScalar(prhs[2]) // arg 3 --> bandwidth
+                                     : selectBandwidth(x, w, m, W, bounded ? bounds : NULL, selector);
+    if (selector == BW_GIVEN ? !(vonMises ? bw >= 0 : bw > 0) || isinf(bw) : isnan(bw)) {
+        free(w);
+        if (xcopy)
+            free(x);
+        if (mcopy)
+            free(mu);
+        if (selector == BW_GIVEN)
+            mexErrMsgIdAndTxt("kreg:inputError","Argument 'bw' must be a positive, finite scalar (or non-negative for 'vonmises').");
+        mexErrMsgIdAndTxt("kreg:inputError","The data are too sparse to select a bandwidth.");
+    }
+    bytes += (double)(selector > BW_SILVERMAN) * 2*selGrid * sizeof(double);
+    endPhase(time, PH_BANDWIDTH, &t0);
     double sigma = 2 * pow(bw, 2);
-    double norm = sqrt(sigma * pi);
+    double norm = vonMises ? 2*pi*besselI0e(bw) : sqrt(sigma * pi); // (the von Mises kernel is scaled by exp(-bw))
 
-    // Outputs
-    plhs[0] = mxCreateDoubleMatrix(1, n, mxREAL);   // allocate return 0
-    plhs[1] = mxCreateDoubleMatrix(1, n, mxREAL);   // allocate return 1
-    double* yhat = mxGetPr(plhs[0]);                // return 0 --> fitted y
-    double* ehat = mxGetPr(plhs[1]);                // return 1 --> SE
-    bool err = nlhs==2; // compute regression error?
+    // Outputs (single precision outputs are computed in double buffers)
+    mxClassID cls = single ? mxSINGLE_CLASS : mxDOUBLE_CLASS;
+    plhs[0] = mxCreateNumericMatrix(1, n, cls, mxREAL); // allocate return 0
+    double* yhat = single ? malloc(n * sizeof(double)) : mxGetPr(plhs[0]); // return 0 --> fitted y
+    double* ehat = NULL;                                // return 1 --> SE
+    bool err = nlhs>=2; // compute regression error?
+    if (err) {
+        plhs[1] = mxCreateNumericMatrix(1, n, cls, mxREAL); // allocate return 1
+        ehat = single ? malloc(n * sizeof(double)) : mxGetPr(plhs[1]);
+    }
+    bytes += (double)single * n * sizeof(double) * (1 + err);
 
-    // Sort inputs
-    double* xs = malloc(m * sizeof(size_t)); // sorted x
-    for (size_t i = 0; i<m; i++)
-        xs[i] = x[i]; // deep copy         
-    qsort(xs, m, sizeof(double), comp);
-    
+    // Binned approximation
+    if (binned)
+    {
+        double* ebound = nlhs>2 ? malloc(n * sizeof(double)) : NULL;
+        double eps = binnedKDE(x, w, m, W, mu, n, bw, &G, bounded ? bounds : NULL, reflect, cdf,
+                               yhat, ebound, err && se ? ehat : NULL);
+        bytes += (double)((3 + (err && se))*G + 1 + (nlhs>2)*n) * sizeof(double); // Grid (and error bound)
+
+        // The RMS deviation of the data from 'yhat' only requires the
+        // first two moments of the data
+        if (err && !se) {
+            double mean, var;
+            moments(x, w, m, W, bounded ? bounds : NULL, &mean, &var);
+            for (size_t i = 0; i<n; i++)
+                ehat[i] = yhat[i] > 0 ? sqrt( var + (mean-yhat[i])*(mean-yhat[i]) ) : 0;
+        }
+        endPhase(time, PH_KERNEL, &t0);
+
+        if (nlhs>2) {
+            const char* fields[] = {"bw", "gridsize", "eps", "errbound"};
+            plhs[2] = mxCreateStructMatrix(1, 1, 4, fields);
+            mxSetField(plhs[2], 0, "bw", mxCreateDoubleScalar(bw));
+            mxSetField(plhs[2], 0, "gridsize", mxCreateDoubleScalar((double)G));
+            mxSetField(plhs[2], 0, "eps", mxCreateDoubleScalar(eps));
+            mxArray* eb = mxCreateDoubleMatrix(1, n, mxREAL);
+            for (size_t i = 0; i<n; i++)
+                mxGetPr(eb)[i] = ebound[i];
+            mxSetField(plhs[2], 0, "errbound", eb);
+            free(ebound);
+        }
+        if (single) {
+            toSingle(plhs[0], yhat, n);
+            if (err)
+                toSingle(plhs[1], ehat, n);
+        }
+        endPhase(time, PH_OUTPUT, &t0);
+        if (nlhs>3)
+            plhs[3] = statsStruct(time, 0, 0, 0, bytes);
+        if (xcopy)
+            free(x);
+        if (mcopy)
+            free(mu);
+        free(w);
+        return;
+    }
+    if (nlhs>2) {
+        const char* fields[] = {"bw"};
+        plhs[2] = mxCreateStructMatrix(1, 1, 1, fields);
+        mxSetField(plhs[2], 0, "bw", mxCreateDoubleScalar(bw));
+    }
+
+    // Sort inputs (a converted 'x' is already a copy)
+    double* xs = x; // sorted x
+    if (!xcopy) {
+        xs = malloc(m * sizeof(double));
+        for (size_t i = 0; i<m; i++)
+            xs[i] = x[i]; // deep copy
+        bytes += (double)m * sizeof(double);
+    }
+    for (size_t i = 0; vonMises && i<m; i++)
+        xs[i] = wrapAngle(xs[i]);
+    endPhase(time, PH_CLEAN, &t0);
+    sort(xs, w, m);
+    endPhase(time, PH_SORT, &t0);
+
+    // Only the (sorted) data within the bounds, [lb0, lb0+mb), contribute
+    // (NaNs are sorted last, beyond +Inf)
+    size_t lb0 = bounded ? lowerBound(xs, 0, m, bounds[0]) : 0,
+            mb = upperBound(xs, lb0, m, bounded ? bounds[1] : INFINITY) - lb0;
+    const double *xb = xs + lb0, *wb = w == NULL ? NULL : w + lb0;
+
+    double mean = 0, var = 0; // (Weighted) mean and variance of the data
+    if (err && !se)
+        moments(xb, wb, mb, W, NULL, &mean, &var);
+
+    // The von Mises kernel is truncated where it falls below the truncation
+    // of the Gaussian kernel, exp(-numBW^2/2), relative to its peak, i.e. at
+    // +/- theta. The (wrapped) data within theta of either end of [-pi, pi)
+    // are copied, shifted by -/+ 2*pi, to the other end, so that the window
+    // of every domain point is contiguous. The cos() and sin() of the data
+    // are computed once, so each kernel weight only costs an exp().
+    double theta = pi, *xp = NULL, *wp = NULL, *cx = NULL, *sx = NULL, cd = 1, sd = 0; // Padded data; cos(), sin()
+    bool uniform = false; // Is the domain equally spaced (by 'step')?
+    if (vonMises) {
+        theta = 1 - numBW*numBW / (2*bw) > -1 ? acos( 1 - numBW*numBW / (2*bw) ) : pi;
+        size_t lo = lowerBound(xb, 0, mb, pi-theta), // Data copied below -pi: [lo, mb)
+               hi = lowerBound(xb, 0, mb, theta-pi), // Data copied above pi: [0, hi)
+               mp = (mb-lo) + mb + hi, k = 0;
+        xp = malloc(mp * sizeof(double));
+        wp = wb == NULL ? NULL : malloc(mp * sizeof(double));
+        cx = malloc(mp * sizeof(double));
+        sx = malloc(mp * sizeof(double));
+        for (size_t j = lo; j<mb+mb+hi; j++, k++) {
+            xp[k] = xb[j%mb] + (j < mb ? -2*pi : j < 2*mb ? 0 : 2*pi);
+            if (wp != NULL)
+                wp[k] = wb[j%mb];
+            cx[k] = cos(xb[j%mb]);
+            sx[k] = sin(xb[j%mb]);
+        }
+        xb = xp, wb = wp, mb = mp;
+        bytes += (double)(3 + (wp != NULL)) * mp * sizeof(double);
+
+        // On an equally spaced domain, cos() and sin() of the domain follow
+        // from the angle-addition recurrences
+        double step = n > 2 ? (mu[n-1]-mu[0]) / (double)(n-1) : 0;
+        uniform = step != 0;
+        for (size_t i = 0; uniform && i<n; i++)
+            uniform = fabs( mu[i]-mu[0]-(double)i*step ) <= 1e-12*(fabs(mu[0]) + fabs(mu[n-1]));
+        cd = cos(step), sd = sin(step);
+    }
+
+    // The CDF counts the (weighted) data below each window
+    double* P = NULL; // Prefix sums of the weights
+    if (cdf && wb != NULL) {
+        P = malloc((mb+1) * sizeof(double));
+        P[0] = 0;
+        for (size_t j = 0; j<mb; j++)
+            P[j+1] = P[j] + wb[j];
+        bytes += (double)(mb+1) * sizeof(double);
+    }
 
     /////////////////////////////////
     // ROUTINE
-    
-    size_t lbIdx, ubIdx = 0;
-    if (err) // start at beginning
-    {
-        // regression error is wildly underestimated if we
-        // do not compute error across the entire dataset
-        lbIdx = 0; 
-        ubIdx = m;
-    }
+    //
+    // The domain is split into one contiguous chunk per thread. Each thread
+    // binary searches for the window of its first domain point, then
+    // gallops forward from the previous window (or binary searches again
+    // where 'd' steps backwards). The error is computed within the same
+    // window (or from the moments of the data), so every domain point
+    // costs O(window) rather than O(m). Bounded data are sorted, so the
+    // window of a domain point near a bound is folded at the bound (i.e.,
+    // clipped to [lb0, lb0+mb)); it already contains every datum whose
+    // reflection about the bound is within reach of the kernel, so
+    // reflection only adds kernel terms within the same window.
+    //
+    // The CDF sums the kernel CDFs, Phi((d-x)/bw). Those of the data below
+    // the window are exactly 1 (in double precision) with a window of
+    // +/- cdfBW bandwidths, so they are counted from the prefix sums of the
+    // weights, and only the window needs erfc().
+    //
+    // For the von Mises kernel, 'bw' is the concentration, and the windows
+    // are searched for the wrapped domain points in the padded data.
 
-    double xh, eh, lbVal, ubVal;
-    for (size_t i = 0; i<n; i++) // step through domain
+    double kernels = 0, winmax = 0; // Number of kernel weights; Widest window
+    #pragma omp parallel reduction(+:kernels)
     {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+              k0 = n*t/T, k1 = n*(t+1)/T, i, j, // This thread's chunk of the domain
+              lbIdx = 0, ubIdx = 0; // Window [lbIdx, ubIdx) of the i_th domain point
+        double xh, eh, v, d, z, below, lbVal, ubVal, wmax = 0,
+               md = 0, mlast = 0, cm = 1, sm = 0, c; // (Wrapped) domain point; cos(), sin() of it
 
-        // STEP 1: find lower/upper bounds for computational easing by
-        // limiting computation to within +/- a few BWs
-        if (!err) 
+        for (i = k0; i<k1; i++) // step through domain
         {
-            ubVal = mu[i]+bw*numBW;
-            lbVal = mu[i]-bw*numBW;
+            // STEP 1: find lower/upper bounds for computational easing by
+            // limiting computation to within +/- a few BWs
+            md = vonMises ? wrapAngle(mu[i]) : mu[i];
+            lbVal = md-(vonMises ? theta : bw*(cdf ? cdfBW : numBW));
+            ubVal = md+(vonMises ? theta : bw*(cdf ? cdfBW : numBW));
+            if (i == k0 || !(md >= mlast)) { // Binary search (also after a NaN)
+                lbIdx = lowerBound(xb, 0, mb, lbVal);
+                ubIdx = lowerBound(xb, lbIdx, mb, ubVal);
+            }
+            else { // Gallop from the previous window
+                lbIdx = gallop(xb, lbIdx, mb, lbVal);
+                ubIdx = gallop(xb, ubIdx > lbIdx ? ubIdx : lbIdx, mb, ubVal);
+            }
+            mlast = md;
+            if (vonMises && uniform && i > k0 && (i-k0) % trigRestart) { // Rotate by 'step'
+                c = cm*cd - sm*sd;
+                sm = sm*cd + cm*sd;
+                cm = c;
+            }
+            else if (vonMises) {
+                cm = cos(mu[i]);
+                sm = sin(mu[i]);
+            }
+            kernels += (double)(ubIdx-lbIdx);
+            wmax = wmax < ubIdx-lbIdx ? (double)(ubIdx-lbIdx) : wmax;
+
+            // STEP 2: build kernels and weight outcome variable by kernels
+            xh = 0, eh = 0; // reset counting variables
+            for (j = lbIdx; j<ubIdx; j++) // step through data
+            {
+                d = xb[j]-mu[i];
+                v = cdf ? erfc( d / (bw*sqrt(2.0)) ) / 2 // kernel CDF of this 'x' datum
+                    : vonMises ? exp( bw*(cx[j]*cm + sx[j]*sm - 1) ) // cos(x-d) by angle addition
+                        : exp( -d*d / sigma );           // kernel weight of this 'x' datum
+                if (reflect) { // plus the kernel weights of its reflections
+                    d = xb[j]+mu[i]-2*bounds[0];
+                    v += d < bw*numBW ? exp( -d*d / sigma ) : 0;
+                    d = 2*bounds[1]-xb[j]-mu[i];
+                    v += d < bw*numBW ? exp( -d*d / sigma ) : 0;
+                }
+                xh += (wb == NULL ? 1 : wb[j]) * v;     // (weighted) kernel sum
+                eh += (wb == NULL ? 1 : wb[j]) * v * v; // (weighted) squared kernel sum
+            }
+            if (cdf) { // plus the data below the window
+                below = P == NULL ? (double)lbIdx : P[lbIdx];
+                xh = (xh + below) / W;
+                eh = (eh + below) / W;
+                z = 1;
+            }
+            else {
+                z = boundMass(mu[i], bw, bounded ? bounds : NULL, reflect);
+                xh = z > 0 ? xh / norm / W : 0;
+                eh = eh / (norm*norm) / W;
+            }
+            yhat[i] = xh > 0 ? xh / z : 0;
 
-            while ( (ubIdx < m) && (xs[ubIdx] < ubVal) ) // step through data
-                ubIdx++;
-            lbIdx = ubIdx < m ? ubIdx : ubIdx-1;
-            while ( (lbIdx > 0) && (xs[lbIdx] > lbVal) ) // step through data
-                lbIdx--;
+            // STEP 3: compute the error: the standard error of 'yhat', or the
+            // RMS deviation of the data from 'yhat'
+            if (err)
+                ehat[i] = xh <= 0 ? 0 : se ? kernelSE(eh, xh, W*W / W2) / z
+                                           : sqrt( var + (mean-yhat[i])*(mean-yhat[i]) );
         }
-        
 
-        // STEP 2: build kernels and weight outcome variable by kernels
-        xh = 0, eh = 0; // reset counting variables
-        for (size_t j=lbIdx; j<ubIdx; j++) // step through data
-            xh += exp( -pow( xs[j]-mu[i],2) / sigma ); // kernel weight this 'x' data
-        xh = xh / norm / m;
-        yhat[i] = xh > 0 ? xh : 0;
+        #pragma omp critical
+        winmax = winmax < wmax ? wmax : winmax;
+    }
+    endPhase(time, PH_KERNEL, &t0);
 
-        // STEP 3: compute regression error
+    if (single) {
+        toSingle(plhs[0], yhat, n);
         if (err)
-        {
-            for (size_t j=lbIdx; j<ubIdx; j++) // step back through data
-                eh = eh + pow(xs[j]-yhat[i],2);  // build e hat
-            ehat[i] = xh > 0 ? sqrt(eh/m) : 0;
-        }
-
+            toSingle(plhs[1], ehat, n);
     }
+    endPhase(time, PH_OUTPUT, &t0);
+    if (nlhs>3)
+        plhs[3] = statsStruct(time, kernels, (double)n, winmax, bytes);
 
     // deallocate sorted arrays before exiting
+    free(P);
+    free(xp);
+    free(wp);
+    free(cx);
+    free(sx);
     free(xs);
+    free(w);
+    if (mcopy)
+        free(mu);
 
 } // mexFunction
 
@@ -1,5 +1,5 @@
 /**************************************************************************
-* Memory and computationally efficient Gaussian kernel regression function.
+* Memory and computationally efficient kernel regression function.
 *
 *
 * USAGE (MATLAB):
@@ -7,11 +7,40 @@
 *   yhat = krege(x,y,d,bw);
 *   yhat = krege(x,y,[],[]);
 *   [xhat,yhat,ehat] = krege(x,y,d,bw);
+*   [xhat,yhat,ehat,info] = krege(x,y,d,bw);
+*   [xhat,yhat,ehat,info,stats] = krege(x,y,d,bw);
+*   [...] = krege(x,y,d,bw,'OptionalArgName1',OptionalArgValue1,...);
+*   [xhat,yhat,ehat,info] = krege(x,y,'cv',bwgrid);
+*   Yhat = krege(x,y,d,[bw1 bw2 ...]);
+*
+*   h = krege('plan',x,d,bw);
+*   h = krege('plan',x,d,bw,'precompute',true);
+*   [...] = krege(h,y);
+*   krege('free',h);
+*
+*   [...] = krege('file',path,d,bw,'dtype','single','layout','separate');
+*
+*   T = krege('threads',T);
+*   S = krege('simd',S);
 *
 * INPUT:
 *    double x[]: The x-coordinate values of the data to be regressed.
-*    double y[]: The y-coordinate values of the data to be regressed.
-*       NOTE: 'x' and 'y' must contain the same number of elements.
+*    double y[]: The y-coordinate values of the data to be regressed. May
+*                also be an (m x K) matrix, where m is the number of
+*                elements in 'x', to regress K signals that share the same
+*                'x' values. The kernel weights are computed once and
+*                applied to every column.
+*       NOTE: (1) 'x' and 'y' must contain the same number of elements
+*                 (or 'y' must have one row per element of 'x').
+*             (2) Rows with an invalid 'x' value, or with no valid 'y'
+*                 values, are excluded. Individual invalid values in a
+*                 matrix 'y' are excluded from their own column only.
+*             (3) 'x', 'y' and 'd' may also be of class single, int16 or
+*                 int32. They are read directly (without a conversion by
+*                 MATLAB) and all sums are accumulated in double. 'x' is
+*                 sorted on keys of its own class, so it is only converted
+*                 into the sorted copy of the data (a circular 'x' is first
+*                 wrapped onto the period in a double copy).
 *
 * OPTIONAL INPUT:
 *    double d[]: Specifies the x-domain of the regression function. It may
@@ -31,24 +60,291 @@
 *               Values of [], bw<0, Nan, or Inf will be defaulted to the
 *               value computed using Silverman's rule
 *               (see https://en.wikipedia.org/wiki/Kernel_density_estimation).
+*               An array of B bandwidths is a bandwidth sweep: the
+*               regression is fit at every bandwidth in one call (see NOTE
+*               (3) of OUTPUT). The data are sorted and cleaned once, and
+*               the (bandwidth x domain) points are shared by the threads.
+*               A sweep cannot be combined with 'cv', 'knn', or
+*               'method','binned'.
+*
+* OPTIONAL NAME-VALUE PAIRS:
+*    'precision': Accuracy of the exp() used to compute kernel weights.
+*                   'full' - (default) Double precision.
+*                   'fast' - Relative error < 1e-8; roughly x2 faster.
+*                   'single' - Single precision (relative error < 2e-7),
+*                              evaluated at twice the SIMD width of 'fast'.
+*       'output': 'double' (default) or 'single'. The class of 'xhat',
+*                 'yhat' and 'ehat' (the fields of 'info' remain double).
+*                 The sums are still accumulated in double precision.
+*                 Unless 'precision' is given, single outputs use 'single'
+*                 precision kernel weights.
+*       'kernel': The kernel (see kreg.m), where x = (data - domain point):
+*                   'gauss'  - (default) exp( -x^2 / (2*bw^2) )
+*                   'pgauss' - exp( -x^2 / (2*bw^2) ) for x >= 0
+*                   'ngauss' - exp( -x^2 / (2*bw^2) ) for x <= 0
+*                   'exp'    - exp( -x / bw ) for x >= 0
+*                   'bexp'   - exp( -|x| / bw ) for x <= 0
+*                   'tri'    - (bw - |x|) / bw for |x| <= bw
+*                   'rect'   - 1 for |x| <= bw/2
+*                   'skew'   - Skew-normal, normpdf(x/bw) * normcdf(-10*x/bw)
+*                   'vonmises' - exp( kappa*(cos(2*pi*x/period)-1) ), with
+*                                kappa = (period/(2*pi*bw))^2 (i.e., a
+*                                Gaussian of 'bw' for small 'bw'). Requires
+*                                'period'.
+*                 The data are limited to the support of the kernel. Kernels
+*                 with unbounded support are truncated where they fall
+*                 below the Gaussian at 3 bandwidths (i.e., exp(-4.5)). The
+*                 default 'bw' is Silverman's rule, or 2*IQR*m^(-1/3) for
+*                 'tri' and 'rect'.
+*                 NOTE: kreg.m scales 'pgauss' and 'ngauss' by bw^4 rather
+*                       than bw^2; here, every Gaussian kernel has a
+*                       standard deviation of 'bw'.
+*       'degree': Degree of the local polynomial fit at each domain point.
+*                   0 - (default) Local constant (Nadaraya-Watson).
+*                   1 - Local linear. Removes the bias at the boundaries of
+*                       the data and in regions of uneven density of 'x'.
+*                   2 - Local quadratic. Also removes the bias at peaks and
+*                       troughs of the regression function.
+*                 Degrees 1 and 2 are fit by weighted least-squares from
+*                 the weighted moments of 'x' within each kernel window.
+*                 Windows with too few distinct 'x' values fall back to a
+*                 lower degree. 'ehat' remains the kernel-weighted spread
+*                 of 'y' about 'yhat'.
+*          'knn': Positive integer k. Use an adaptive bandwidth at each
+*                 domain point, equal to twice the distance to its k_th
+*                 nearest datum (as in kreg.m), superseding 'bw'. If that
+*                 distance is 0, the distance to the nearest non-coincident
+*                 datum is used. The k nearest data are found by sliding a
+*                 window along the sorted data, in O(n + m) time and with
+*                 no additional memory.
+*        'nboot': Number of bootstrap replicates B (default 0). Pointwise
+*                 percentile confidence bands are returned in 'info'. Each
+*                 replicate resamples the (x,y) pairs with replacement and
+*                 refits the regression with the same bandwidth, kernel and
+*                 degree. Replicates run in parallel, and each draws from
+*                 its own counter-based random number stream, so the bands
+*                 do not depend on the number of threads.
+*        'alpha': The bands are the alpha/2 and 1-alpha/2 percentiles of
+*                 the replicates (default 0.05, i.e., 95% bands).
+*         'seed': Non-negative integer seed of the resamples. By default, a
+*                 random seed is used (and returned in 'info').
+*       'period': Positive scalar. Treat 'x' as circular with this period
+*                 (e.g., 2*pi for directions in radians). 'x' and 'd' are
+*                 wrapped onto [0,period), and the kernel distance from each
+*                 domain point to each datum is its shortest signed distance
+*                 around the circle, in [-period/2,period/2). By default,
+*                 'd' is spaced period/n apart from 0. Only the data within
+*                 reach of the kernel of either end of the period are copied
+*                 around the circle, so a circular regression costs about
+*                 the same as a linear one. Cannot be combined with 'cv' or
+*                 'method','binned'.
+*       'robust': Number of robustness iterations (default 0; LOWESS uses
+*                 3). Each iteration fits the regression at every datum
+*                 (with the same kernel, bandwidth and degree) and weights
+*                 each datum by the bisquare of its residual, (1-u^2)^2 for
+*                 u = residual/(6*median(|residuals|)) (0 if |u| >= 1), so
+*                 that outliers are discounted. Each iteration costs about
+*                 one regression evaluated at the m data, in parallel. Each
+*                 column of a matrix 'y' is reweighted separately. The
+*                 bootstrap reuses the final weights. Cannot be combined
+*                 with 'cv', 'method','binned', or a bandwidth sweep.
+*      'weights': Non-negative observation weights, one per element of 'x'
+*                 (e.g., inverse-probability weights, or the number of
+*                 repeats of each unique datum). The weights multiply the
+*                 kernel weights in every sum (and in 'cv', 'robust',
+*                 'quantiles' and 'nboot'). Rows with a weight of 0 or NaN
+*                 are excluded. For the default bandwidth, the sample size
+*                 is the effective sample size sum(w)^2/sum(w.^2), with the
+*                 matching unbiased weighted std and a weighted IQR, so the
+*                 default does not depend on the scale of the weights (for
+*                 counts of repeated data, pass the bandwidth of the
+*                 repeated data explicitly). 'knn' still counts data, not
+*                 weights.
+*    'quantiles': Array of Q probabilities in [0,1]. The kernel-weighted
+*                 quantiles of 'y' at each domain point are returned in
+*                 'info' (e.g., [.1 .5 .9] for the median and 10/90% curves).
+*                 Each datum in the window is weighted by its kernel weight,
+*                 and the p_th quantile is the smallest 'y' at which the
+*                 cumulative weight reaches p times the total (or the
+*                 midpoint of the two values where it is reached exactly).
+*                 The values of each window are kept sorted as the window
+*                 slides along the domain, and all Q quantiles are found in
+*                 one pass through the window. Requires the exact method.
+*           'cv': Array (of class double) of candidate bandwidths. The
+*                 bandwidth is selected by minimizing the leave-one-out
+*                 prediction error across these candidates, superseding
+*                 'bw'. Pass [] to search 25 log-spaced multiples (0.1 to
+*                 3.16) of Silverman's rule.
+*       'method': 'exact' (default) or 'binned'. The binned approximation
+*                 linearly bins the data onto a grid, convolves the binned
+*                 sums with the kernel, and interpolates onto 'd'. Its cost
+*                 is O(m + G*L) for m data, G grid points and a kernel
+*                 spanning L grid points, and does not require sorting 'x'.
+*     'gridsize': Number of grid points for the binned approximation. By
+*                 default, there are 16 grid points per bandwidth (minimum
+*                 4096, maximum 2^22).
+*      'threads': Number of threads of this call. By default, the number set
+*                 by krege('threads',T) (see THREADS), else the OpenMP
+*                 default (e.g., OMP_NUM_THREADS).
+*     'schedule': 'static' (default), 'dynamic', or 'guided'. The OpenMP
+*                 schedule of the domain points among the threads ('dynamic'
+*                 and 'guided' hand out chunks of 16). Domain points with
+*                 windows of uneven sizes (e.g., 'knn', or clustered 'x') are
+*                 better balanced by 'dynamic' or 'guided'.
+**
+* PLANS:
+*   When many regressions share the same 'x', 'd' and 'bw' (e.g., bootstrap
+*   resamples or permutations of 'y'), krege('plan',x,d,bw) sorts 'x',
+*   removes its invalid values, sets the domain/bandwidth, and finds the
+*   kernel windows once. These are kept in persistent MEX memory and a
+*   uint64 handle 'h' is returned. Each call to krege(h,y) then only gathers
+*   'y' and computes the weighted sums; it returns the same outputs as
+*   krege(x,y,d,bw). Invalid values of 'y' are excluded from their own
+*   column only. Note that a default domain or bandwidth is computed from
+*   the valid 'x' alone. Plans accept 'precision', 'output', and the
+*   name-value pair
+*   'precompute': If true, the kernel weights are also computed once and
+*                 stored (one weight per datum in each window). This uses
+*                 more memory, but removes every exp() from krege(h,y).
+*   Plans are released with krege('free',h), or all at once with
+*   krege('free') or 'clear krege'.
+*
+* FILES:
+*   krege('file',path,d,bw) regresses a raw binary file of (x,y) records
+*   that need not fit in memory (e.g., 10^9 samples of a time series). The
+*   records must be sorted by 'x' (and 'x' must be finite). The file is
+*   memory-mapped, and the windows of the domain are found by binary search
+*   of the file. The domain is then regressed in tiles: the records spanned
+*   by the windows of a tile are copied into memory, regressed in parallel,
+*   and released, so that the resident memory is bounded by the tile size
+*   rather than the file size. Invalid 'y' values are excluded. A default
+*   domain spans the first and last 'x', and a default bandwidth is computed
+*   from every record (in one pass through the file). Files accept
+*   'kernel', 'degree', 'precision', 'output', 'threads', 'schedule', and
+*   the name-value pairs
+*        'dtype': Class of every value in the file: 'double' (default),
+*                 'single', 'int16', or 'int32'.
+*       'layout': 'interleaved' (default), i.e., x1 y1 x2 y2 ..., or
+*                 'separate', i.e., x1 x2 ... followed by y1 y2 ....
+*       'offset': Number of header bytes to skip (default 0). The rest of
+*                 the file must be whole records.
+*       'verify': If true (default), verify that 'x' is sorted and finite,
+*                 in one pass through the file.
+*     'tilesize': Maximum number of records per tile (default 2^22). A
+*                 tile always holds the window of at least one domain point.
+*   'info' holds 'bw', and the number of 'records' and 'tiles'. In 'stats',
+*   reading the file (to verify it, and to copy each tile) is 'clean'.
+*
+* THREADS:
+*   krege('threads',T) sets the number of threads of every later call
+*   (including krege(h,y) and krege('file',...)) until 'clear krege'.
+*   krege('threads',0) restores the OpenMP default, and T = krege('threads')
+*   returns the number in effect. When several MATLAB workers share a
+*   machine, give each its own share of the cores (e.g., krege('threads',8)
+*   on each of 4 workers on 32 cores), and pin the threads of each worker to
+*   its cores with the OpenMP environment variables of that worker, e.g.,
+*   OMP_PLACES="{0}:8" (cores 0-7) and OMP_PROC_BIND=close. The sorted
+*   copies of the data are first written by the threads that regress them,
+*   so that on NUMA systems they are placed on the memory nodes of those
+*   threads (given pinned threads).
+*
+* SIMD:
+*   krege('simd',S) sets the dispatch path of the vectorized exp() of every
+*   later call until 'clear krege': 'scalar', 'avx2', 'avx512', or 'auto'
+*   (default; the widest path supported by the CPU). A path the CPU does
+*   not support is an error. S = krege('simd') returns the path in effect.
+*   Every path meets the error bounds of 'precision' (see krege_test.m).
 *
 * OUTPUT:
 *   double xhat[]: The domain of the regression function.
 *   double yhat[]: The fitted regression function.
 *   double ehat[]: The standard error of the fitted regression function error.
-*       NOTE: (1) All outputs have an equal length to 'd'. 
+*   struct   info: Details of the fit, with fields
+*                   bw     - The kernel bandwidth that was used ((1 x n)
+*                            when 'knn' is set, (1 x B) for a sweep).
+*                   cvgrid - ('cv' only) The candidate bandwidths.
+*                   cverr  - ('cv' only) The leave-one-out mean squared
+*                            prediction error of each candidate.
+*                   gridsize - ('binned' only) The number of grid points.
+*                   eps      - ('binned' only) The bound on the error of
+*                              each kernel weight, relative to the peak.
+*                   errbound - ('binned' only) Bound on the absolute
+*                              difference between 'yhat' and its exact
+*                              value (same size as 'yhat').
+*                   lo, hi   - ('nboot' only) The lower/upper bootstrap
+*                              confidence bands (same size as 'yhat').
+*                              Replicates with no data in the kernel
+*                              window of a domain point are ignored there.
+*                   nboot    - ('nboot' only) The number of replicates.
+*                   seed     - ('nboot' only) The seed of the resamples.
+*                   quantiles - ('quantiles' only) The kernel-weighted
+*                               quantiles, (n x Q), or (n x Q x K) when 'y'
+*                               is a matrix ((n x B x Q [x K]) for a sweep).
+*                               Windows with no data are NaN.
+*                   probs     - ('quantiles' only) Their probabilities.
+*   struct  stats: Instrumentation of the call (e.g., for capacity planning
+*                  or production logs), with fields
+*                   time    - Wall time (s) of each phase of the call:
+*                             'sort' (sorting 'x'), 'clean' (copying the
+*                             data and removing invalid values), 'domain',
+*                             'bandwidth' (default bandwidth, 'cv', 'knn'),
+*                             'windows' (window search), 'kernel' (kernel
+*                             weights and sums), 'extra' ('robust', 'nboot',
+*                             'quantiles'), 'output', and their 'total'.
+*                   threads - The number of threads.
+*                   simd    - The dispatch path of the exp() (see SIMD).
+*                   kernels - The number of kernel weights (i.e., the sum of
+*                             the window sizes) of the regression.
+*                   winmean - The mean number of data per window.
+*                   winmax  - The largest number of data in a window.
+*                   bytes   - The bytes of the working arrays (not
+*                             including the outputs).
+*                  Phases are timed with omp_get_wtime(), whether or not
+*                  'stats' is returned. The binned approximation has no
+*                  windows ('winmean' and 'winmax' are NaN).
+*       NOTE: (1) All outputs have an equal length to 'd'. When 'y' is an
+*                 (m x K) matrix, 'yhat' and 'ehat' are (n x K) matrices,
+*                 where n is the number of elements in 'd'.
 *             (2) If a single output is designated, the function returns 'yhat',
 *                   e.g., scatter(x,y); hold on; plot(d,krege(x,y,d));
-*                 If 2 or 3 outputs are designated, the function returns
-*                 them in the order 'xhat', 'yhat', 'ehat'.
+*                 If 2 to 5 outputs are designated, the function returns
+*                 them in the order 'xhat', 'yhat', 'ehat', 'info', 'stats'.
+*             (3) For a sweep of B bandwidths, 'yhat', 'ehat' and the
+*                 bootstrap bands are (n x B) matrices, with one column per
+*                 bandwidth, or (n x B x K) arrays when 'y' is a matrix.
 *
 * EXCEPTIONS:
-*   1) Greater than 3 values were returned.
+*   1) Greater than 5 values were returned.
 *   2) Fewer than 2 arguments were passed.
 *   3) Empty array passed as an argument for 'x' or 'y'.
 *   4) Mismatched number of elements in 'x' and 'y'.
 *   5) Insufficient valid (~isnan && ~isinf) elements in 'x' or 'y'.
 *   6) Insufficient valid (~isnan && ~isinf) elements in array 'd'.
+*   7) Unrecognized or invalid optional name-value pair.
+*   8) No candidate bandwidth in 'cv' leaves any datum with a neighbour.
+*   9) Invalid (or freed) plan handle, or an option not supported by plans.
+*  10) 'degree' greater than 0, or a kernel other than 'gauss', requested
+*      with the binned approximation.
+*  11) 'knn' exceeds the number of valid data, or is combined with 'cv' or
+*      the binned approximation.
+*  12) 'nboot' requested without the 'info' output, or with the binned
+*      approximation.
+*  13) 'x', 'y' or 'd' is not of class double, single, int16 or int32.
+*  14) 'period' combined with 'cv' or the binned approximation, or the
+*      'vonmises' kernel requested without 'period'.
+*  15) A bandwidth sweep combined with 'cv', 'knn' or the binned
+*      approximation.
+*  16) 'robust' combined with 'cv', the binned approximation, or a
+*      bandwidth sweep.
+*  17) 'quantiles' requested without the 'info' output, or with the binned
+*      approximation.
+*  18) 'weights' of the wrong class or length, or with a negative or
+*      infinite weight.
+*  19) krege('file',...) could not map the file, the file is not a whole
+*      number of records, its 'x' is not sorted, or an option that files do
+*      not support was given (or a file option was given elsewhere).
+*  20) The binned approximation with a bandwidth that is not positive
+*      (e.g., the default bandwidth of data without spread).
 *
 *
 *
@@ -64,6 +360,16 @@
 * DEPENDENCIES:
 *   OpenMP v2.0 or later (https://www.openmp.org/resources/openmp-compilers-tools/)
 *
+*   The 'dynamic' and 'guided' schedules require OpenMP v3.0 or later
+*   (otherwise, the schedule may be set with OMP_SCHEDULE).
+*
+*   Files are memory-mapped with mmap() on POSIX systems and with
+*   CreateFileMapping() on Windows.
+*
+*   On x86 CPUs, kernel weights are computed with AVX-512 or AVX2 (+FMA)
+*   instructions when available. Support is detected at runtime, so no
+*   additional compiler flags are required.
+*
 * AUTHOR:
 *   Devin H. Kehoe
 *   dhkehoe@gmail.com
@@ -79,6 +385,33 @@
 *   dhk     nov 28, 2025    -flexible domain specification
 *                           -return values optional + flexibly ordered
 *   dhk     nov 29, 2025    -adopted OpenMP for parallelization (x5 speed-up)
+*   dhk     oct 16, 2026    -'y' may be a matrix; kernel weights are shared by
+*                            all columns in a cache-blocked loop
+*                           -vectorized exp() with runtime AVX2/AVX-512 dispatch
+*                           -optional name-value pairs; 'precision' option
+*                           -leave-one-out cross-validated bandwidth ('cv');
+*                            optional 'info' output
+*                           -binned approximation ('method','binned')
+*                           -parallel binary/galloping search of kernel windows
+*                           -parallel radix sort; skip sorting of already sorted data
+*                           -persistent plans for repeated regressions ('plan')
+*                           -local linear/quadratic regression ('degree')
+*                           -adaptive k-nearest-neighbour bandwidth ('knn')
+*                           -kernels of kreg.m with exact support ('kernel')
+*                           -parallel bootstrap confidence bands ('nboot')
+*                           -single/int16/int32 inputs; single outputs and
+*                            single precision kernels ('output')
+*                           -circular 'x' ('period') and von Mises kernel
+*                           -bandwidth sweep (an array of bandwidths)
+*                           -robust (LOWESS) bisquare reweighting ('robust')
+*                           -kernel-weighted quantiles ('quantiles')
+*                           -observation weights ('weights'); weighted std and
+*                            exact (weighted) IQR for the default bandwidth
+*                           -streaming regression of memory-mapped files ('file')
+*                           -thread count ('threads'), loop schedule ('schedule'),
+*                            and first-touch placement of the sorted data
+*                           -per-phase timing and counters ('stats' output)
+*                           -dispatch path of the exp() ('simd'); krege_test.m
 *
 *
 * DO TO:
@@ -88,10 +421,41 @@
 #include "mex.h"
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
 #include <omp.h>
+#ifdef _WIN32 // Memory-mapped files
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define DEFAULT_LS  100 // Default number of points for linspace
 #define NUM_BW      3   // Smoothing range in units of bandwidth
+#define DEFAULT_CV  25  // Default number of bandwidths searched by cross-validation
+#define DEFAULT_GRID 4096 // Minimum number of grid points for the binned approximation
+#define MAX_GRID    (1<<22) // Maximum number of grid points for the binned approximation
+#define BIN_RES     16  // Default number of grid points per bandwidth for the binned approximation
+#define RADIX_BITS  11  // Number of bits sorted per pass of the radix sort
+#define RADIX_SIZE  (1<<RADIX_BITS) // Number of buckets per pass of the radix sort
+#define RADIX_MIN   4096 // Smaller arrays are sorted with qsort()
+#define COL_BLOCK   64  // Number of columns of 'y' that share one pass through the kernel buffer
+#define SKEW_ALPHA  10  // Shape of the skew-normal kernel (its left tail is the Gaussian)
+#define SQRT1_2     0.70710678118654752440 // 1/sqrt(2) (M_SQRT1_2 is not defined by MSVC)
+#define PI          3.14159265358979323846 // (M_PI is not defined by MSVC)
+#define BOOT_WTS    (1<<25) // Maximum number of kernel weights shared by the bootstrap replicates
+#define MAX_DEGREE  2   // Maximum degree of the local polynomial
+#define NUM_MOM     (2*MAX_DEGREE+1) // Number of weighted moments of a local polynomial fit
+#define QUANT_BUF   (1<<20) // Maximum number of sorted values held per thread for kernel-weighted quantiles
+#define DEFAULT_TILE (1<<22) // Default maximum number of data per tile of a memory-mapped file
+#define MAX_THREADS 4096    // Maximum number of threads of the 'threads' option
+#define SCHED_CHUNK 16      // Chunk size of the 'dynamic' and 'guided' schedules (domain points)
 
 /**************************************************************************
 *                                  TYPES                                  *
@@ -103,26 +467,147 @@ typedef struct iarray
     double value;
 } iarray;
 
+// Schedules of the parallel loops over the domain (see useThreads())
+enum { SCHED_STATIC, SCHED_DYNAMIC, SCHED_GUIDED };
+
+// Number of threads and schedule of the parallel regions of this call (see
+// useThreads()). They are passed to each region, rather than set in the
+// OpenMP runtime, whose settings are shared with other MEX files (and later
+// calls) on the MATLAB thread.
+static int numThreads = 1, loopSchedule = SCHED_STATIC;
+
+// Kernels (see kernelEval())
+enum { KERN_GAUSS, KERN_PGAUSS, KERN_NGAUSS, KERN_EXP, KERN_BEXP, KERN_TRI, KERN_RECT, KERN_SKEW, KERN_VONMISES, NUM_KERNELS };
+
+// Support of a kernel, in units of bandwidth. The window of domain point mu
+// is [mu+lo*bw, mu+hi*bw), or [mu+lo*bw, mu+hi*bw] if 'closed'.
+typedef struct kernelInfo
+{
+    const char* name;
+    double      lo, hi;
+    bool        closed;
+} kernelInfo;
+
+// Kernels with unbounded support are truncated where their weight falls
+// below that of the Gaussian at NUM_BW bandwidths, i.e., exp(-NUM_BW^2/2)
+static const kernelInfo kernels[NUM_KERNELS] = {
+    { "gauss",  -NUM_BW,              NUM_BW,              false },
+    { "pgauss",  0,                   NUM_BW,              false },
+    { "ngauss", -NUM_BW,              0,                   true  },
+    { "exp",     0,                   NUM_BW*NUM_BW/2.0,   false },
+    { "bexp",   -NUM_BW*NUM_BW/2.0,   0,                   true  },
+    { "tri",    -1,                   1,                   false },
+    { "rect",   -.5,                  .5,                  true  },
+    { "skew",   -NUM_BW,              NUM_BW/(double)SKEW_ALPHA, false },
+    { "vonmises", -NUM_BW,            NUM_BW,              false } // (For small 'bw'; see kernelSupport())
+};
+
+// Optional name-value pairs
+typedef struct options
+{
+    int     kernel;     // Kernel (KERN_*)
+    int     precision;  // Accuracy of the kernel exp()
+    int     degree;     // Degree of the local polynomial
+    bool    cv;         // Select the bandwidth by leave-one-out cross-validation?
+    double* cvgrid;     // Candidate bandwidths for cross-validation
+    size_t  G;          // Number of candidate bandwidths
+    bool    binned;     // Use the binned approximation?
+    size_t  gridSize;   // Number of grid points for the binned approximation (0 --> default)
+    bool    precompute; // Precompute the kernel weights of a plan?
+    size_t  knn;        // Number of nearest neighbours of the adaptive bandwidth (0 --> fixed bandwidth)
+    size_t  nboot;      // Number of bootstrap replicates (0 --> no bootstrap)
+    double  alpha;      // Bootstrap bands are the alpha/2 and 1-alpha/2 percentiles
+    double  seed;       // Seed of the bootstrap resamples (NaN --> random)
+    bool    single;     // Return single precision outputs?
+    double  period;     // Period of a circular 'x' (0 --> linear)
+    size_t  robust;     // Number of robustness iterations (0 --> not robust)
+    double* probs;      // Probabilities of the kernel-weighted quantiles
+    size_t  Q;          // Number of quantiles (0 --> none)
+    const mxArray* weights; // Observation weights of the data (NULL --> unweighted)
+    bool    file;       // Was an option of krege('file',...) given?
+    mxClassID dtype;    // Class of the values of a file
+    bool    interleaved; // Are the (x,y) values of a file interleaved (or separate columns)?
+    size_t  offset;     // Number of header bytes of a file
+    bool    verify;     // Verify that the 'x' of a file is sorted?
+    size_t  tileSize;   // Maximum number of data per tile of a file
+    int     threads;    // Number of threads (0 --> the setting of krege('threads',T))
+    int     schedule;   // Schedule of the loops over the domain (SCHED_*)
+} options;
+
+// Persistent plan for repeated regressions on the same 'x', 'd' and 'bw'.
+// All arrays are allocated in MEX-persistent memory.
+typedef struct kplan
+{
+    uint64_t id;        // Handle returned to MATLAB
+    size_t   M, m, n, B; // Number of 'x' (including invalid cases); Number of valid 'x'; Number of domain points; Number of bandwidths
+    size_t*  perm;      // Indices of the valid elements of 'x', in sorted order
+    double*  xs;        // Sorted valid 'x'
+    double*  mus;       // Sorted valid domain
+    size_t*  lbIdx;     // Kernel windows [lbIdx[k], ubIdx[k]) of each domain point (of each bandwidth)
+    size_t*  ubIdx;
+    size_t*  off;       // Kernel weights of the k_th domain point start at wts[off[k]]
+    double*  wts;       // Precomputed kernel weights (NULL if not precomputed)
+    double   bw;        // Kernel bandwidth
+    double*  bws;       // Adaptive (or swept) bandwidth of each domain point (NULL if 'bw' is fixed)
+    int      kernel;    // Kernel (KERN_*)
+    int      precision; // Accuracy of the kernel exp()
+    int      degree;    // Degree of the local polynomial
+    bool     single;    // Return single precision outputs?
+    double   period;    // Period of a circular 'x' (0 --> linear)
+    struct kplan* next; // Next live plan
+} kplan;
+
+// Phases of a call, timed for the 'stats' output
+enum { PH_SORT, PH_CLEAN, PH_DOMAIN, PH_BANDWIDTH, PH_WINDOWS, PH_KERNEL, PH_EXTRA, PH_OUTPUT, NUM_PHASES };
+static const char* phaseNames[NUM_PHASES] = { "sort", "clean", "domain", "bandwidth", "windows", "kernel", "extra", "output" };
+
+// Wall time of each phase and counters of a call (see statsStruct())
+typedef struct kstats
+{
+    double t0;               // Start of the current phase (omp_get_wtime())
+    double time[NUM_PHASES]; // Wall time of each phase
+    double windows;          // Number of kernel windows
+    double kernels;          // Number of kernel weights (i.e., the sum of the window sizes)
+    double winmax;           // Size of the widest window
+    double bytes;            // Bytes of the working arrays
+} kstats;
+
 /**************************************************************************
 *                                FUNCTIONS                                *
 **************************************************************************/
-// Define comparison function for qsort operating on indexed-arrays
+// Element 'i' of the data of a supported class, as a double
+double getValue(const void* data, mxClassID cls, size_t i)
+{
+    switch (cls) {
+        case mxSINGLE_CLASS: return ((const float*)data)[i];
+        case mxINT16_CLASS:  return ((const int16_t*)data)[i];
+        case mxINT32_CLASS:  return ((const int32_t*)data)[i];
+        default:             return ((const double*)data)[i];
+    }
+}
+
+// Define comparison function for qsort operating on indexed-arrays. NaNs
+// are sorted last (otherwise they compare equal to every value, which
+// leaves the rest of the array unsorted).
 int comp(const void* ia, const void* ib)
 {
     double a = ((iarray*)ia)->value;
     double b = ((iarray*)ib)->value;
+    if (isnan(a) || isnan(b))
+        return isnan(a) - isnan(b);
     return (a > b) - (a < b);
 }
 
-// Custom implementation of qsort where just the sorted list of indices is returned
-size_t* qsortIndex(const double arr[], size_t n)
+// Custom implementation of qsort where just the sorted list of indices is
+// returned. 'data' is of class 'cls' (see getValue()).
+size_t* qsortIndex(const void* data, mxClassID cls, size_t n)
 {
     // Allocate indexed-array instance, then deep copy the input data array
     iarray* ia = malloc(n * sizeof(iarray));
     for (size_t i = 0; i<n; i++)
     {
         ia[i].index = i;
-        ia[i].value = arr[i];
+        ia[i].value = getValue(data, cls, i);
     }
 
     // qsort() the indexed-array
@@ -139,6 +624,138 @@ size_t* qsortIndex(const double arr[], size_t n)
     return idx;
 }
 
+// Map a double onto an unsigned integer with the same ordering, by flipping
+// the sign bit of positive values and all bits of negative values
+// (NaNs are sorted to the ends, where they are later excluded)
+uint64_t sortKey(double v)
+{
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return (u >> 63) ? ~u : u ^ 0x8000000000000000ULL;
+}
+
+// Key of element 'i' of the data of class 'cls', built from its native
+// type: the bits of a single are mapped as in sortKey(), and integers are
+// offset by their minimum. Narrower keys leave the upper digits equal, so
+// those passes of the radix sort are skipped.
+uint64_t classKey(const void* data, mxClassID cls, size_t i)
+{
+    uint32_t u;
+    switch (cls) {
+        case mxSINGLE_CLASS:
+            memcpy(&u, (const float*)data + i, sizeof(u));
+            return (u >> 31) ? ~u : u ^ 0x80000000U;
+        case mxINT16_CLASS: return (uint64_t)(((const int16_t*)data)[i] + 32768);
+        case mxINT32_CLASS: return (uint64_t)((int64_t)((const int32_t*)data)[i] + 2147483648LL);
+        default:            return sortKey(((const double*)data)[i]);
+    }
+}
+
+// LSD radix sort on the keys of 'data' of class 'cls' (see classKey()), where
+// just the sorted list of indices is returned. Sorts RADIX_BITS bits per
+// pass, carrying the
+// index along with the key. Each thread histograms and scatters a contiguous
+// chunk of the data, which keeps each pass stable. Passes in which every key
+// shares the same digit (e.g., the exponent bits of data in a narrow range)
+// are skipped.
+size_t* radixSortIndex(const void* data, mxClassID cls, size_t n)
+{
+    uint64_t *key[2] = { malloc(n * sizeof(uint64_t)), malloc(n * sizeof(uint64_t)) };
+    size_t   *idx[2] = { malloc(n * sizeof(size_t)),   malloc(n * sizeof(size_t)) };
+    int T = numThreads, src = 0;
+    size_t* hist = malloc((size_t)T * RADIX_SIZE * sizeof(size_t)); // Per-thread histograms
+    long long int i;
+
+    #pragma omp parallel for schedule(static) num_threads(numThreads)
+    for (i = 0; i<(long long int)n; i++) {
+        key[0][i] = classKey(data, cls, (size_t)i);
+        idx[0][i] = (size_t)i;
+    }
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t t = (size_t)omp_get_thread_num(), nt = (size_t)omp_get_num_threads(),
+               a = n*t/nt, b = n*(t+1)/nt, j, d, sum, p,
+              *h = hist + t*RADIX_SIZE,
+              *off = malloc(RADIX_SIZE * sizeof(size_t)); // This thread's write position in each bucket
+        int shift, s = 0, dst;
+
+        for (shift = 0; shift<64; shift += RADIX_BITS)
+        {
+            // Histogram this thread's chunk
+            for (d = 0; d<RADIX_SIZE; d++)
+                h[d] = 0;
+            for (j = a; j<b; j++)
+                h[(key[s][j] >> shift) & (RADIX_SIZE-1)]++;
+            #pragma omp barrier
+
+            // Bucket d of thread t starts after all of buckets 0..d-1, and
+            // after bucket d of threads 0..t-1
+            for (sum = 0, d = 0; d<RADIX_SIZE; d++)
+                for (j = 0; j<nt; j++) {
+                    if (j == t)
+                        off[d] = sum;
+                    sum += hist[j*RADIX_SIZE+d];
+                }
+
+            // Skip this pass if every key falls in the same bucket
+            for (sum = 0, j = 0; j<nt; j++)
+                sum += hist[j*RADIX_SIZE+((key[s][0] >> shift) & (RADIX_SIZE-1))];
+
+            if (sum < n) // Scatter this thread's chunk
+            {
+                dst = 1-s;
+                for (j = a; j<b; j++) {
+                    p = off[(key[s][j] >> shift) & (RADIX_SIZE-1)]++;
+                    key[dst][p] = key[s][j];
+                    idx[dst][p] = idx[s][j];
+                }
+                s = dst;
+            }
+            #pragma omp barrier
+        }
+        free(off);
+
+        #pragma omp single
+        src = s;
+    }
+
+    free(hist);
+    free(key[0]);
+    free(key[1]);
+    free(idx[1-src]);
+    return idx[src];
+}
+
+// Sorted list of indices of 'data' of class 'cls', which is read in place
+// (without a converted copy). Data that is already sorted (e.g., time
+// ordered) is detected in O(n) and not sorted at all; small arrays use
+// qsort(); everything else is radix sorted. Any NaN counts as unsorted, as
+// it compares false with its neighbours (and would hide a descent).
+size_t* sortIndexOf(const void* data, mxClassID cls, size_t n)
+{
+    size_t i;
+    double v, prev = 0;
+    for (i = 0; i<n; i++, prev = v) {
+        v = getValue(data, cls, i);
+        if (isnan(v) || (i > 0 && v < prev))
+            break;
+    }
+    if (i >= n) { // Already sorted
+        size_t* idx = malloc(n * sizeof(size_t));
+        for (i = 0; i<n; i++)
+            idx[i] = i;
+        return idx;
+    }
+    return n < RADIX_MIN ? qsortIndex(data, cls, n) : radixSortIndex(data, cls, n);
+}
+
+// Sorted list of indices of 'arr'
+size_t* sortIndex(const double arr[], size_t n)
+{
+    return sortIndexOf(arr, mxDOUBLE_CLASS, n);
+}
+
 // Replicate MATLAB linspace()
 double* linspace(double min, double max, size_t n)
 {
@@ -149,6 +766,39 @@ double* linspace(double min, double max, size_t n)
     return x;
 }
 
+// Allocate 'n' doubles whose pages are first written by the threads, each
+// writing a contiguous chunk (as the threads share the sorted domain), so
+// that on NUMA systems every page is placed on the memory node of a thread
+// that reads it, rather than on the node of the calling thread.
+double* touchedAlloc(size_t n)
+{
+    double* a = malloc(n * sizeof(double));
+    long long int i; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    #pragma omp parallel for schedule(static) num_threads(numThreads)
+    for (i = 0; i<(long long int)n; i++)
+        a[i] = 0;
+    return a;
+}
+
+// memcpy() in one contiguous chunk per thread (see touchedAlloc())
+void parallelCopy(void* dst, const void* src, size_t bytes)
+{
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+               a = bytes/T*t, b = t+1 == T ? bytes : bytes/T*(t+1);
+        memcpy((char*)dst + a, (const char*)src + a, b-a);
+    }
+}
+
+// Wrap 'v' onto [0,period)
+double wrap(double v, double period)
+{
+    v -= period * floor(v / period);
+    return v < period ? v : 0; // (v may round up to the period)
+}
+
 // Compute min/max of an array
 double getmin(const double x[], size_t n)
 {
@@ -178,353 +828,3344 @@ double roundn(double x, size_t n)
     return round(x * f) / f;
 }
 
-// Compute interquartile range using the exact method
-double iqr(const double x[], size_t n)
+// Effective sample size of the weights 'w' (NULL for equal weights),
+// sum(w)^2/sum(w.^2), which is n for equal weights and does not depend on
+// the scale of the weights
+double effectiveSize(const double w[], size_t n)
+{
+    double W = 0, W2 = 0; // Sum of (squared) weights
+    if (w == NULL)
+        return (double)n;
+    for (size_t i = 0; i<n; i++) {
+        W  += w[i];
+        W2 += w[i] * w[i];
+    }
+    return W*W / W2;
+}
+
+// The value at index 't' of the sorted data x[idx[0]], x[idx[1]], ..., when
+// each datum is repeated as many times as its weight in 'w' times 'c' (once
+// if NULL)
+double expandedValue(const double x[], const double w[], double c, const size_t idx[], size_t n, double t)
+{
+    double C = 0; // Cumulative weight
+    for (size_t i = 0; i<n; i++) {
+        C += w == NULL ? 1 : c*w[idx[i]];
+        if (t < C)
+            return x[idx[i]];
+    }
+    return x[idx[n-1]];
+}
+
+// Compute the interquartile range using the exact method. As in
+// percentile(), the quantile p is at index p*W-0.5 of the sorted data, with
+// linear interpolation in between. 'w' holds the weight of each datum (NULL
+// for equal weights): the weights are scaled to sum to the effective sample
+// size W = sum(w)^2/sum(w.^2), and the data are indexed as if each datum
+// were repeated (scaled) w times. For equal weights, W = n.
+double iqr(const double x[], const double w[], size_t n)
 {
     // Protect against n<=1
     if (n<2)
         return NAN;
 
-    double *f = calloc(DEFAULT_LS, sizeof(double)); // Empirical CDF
-    double *d = linspace(getmin(x, n), getmax(x, n), DEFAULT_LS); // Function domain
-    double r, lb = NAN, ub, interval = (d[1]-d[0])/2; // round(f[i]), lower/upper bound of IQR, interval between domain points
-
-    for(size_t i = 0; i<DEFAULT_LS; i++) // Step through domain
+    size_t *idx = sortIndex(x, n), i; // (Not sorted if already sorted)
+    double W = effectiveSize(w, n), S = 0, c, q[2], t[2] = { .25, .75 }, r, l; // Sum of the weights; Their scale
+    for (i = 0; w != NULL && i<n; i++)
+        S += w[i];
+    c = w == NULL ? 1 : W / S;
+    for (i = 0; i<2; i++)
     {
-        for(size_t j = 0; j<n; j++) // Step through data
-            f[i] += d[i] - interval < x[j] && x[j] <= d[i] + interval; // Count instances in this bin
-        
-        f[i] /= n-1; // Convert to proportion
-
-        // Convert to cumulative sum
-        if (i>0)
-            f[i] += f[i-1];
-
-        r = roundn(f[i],2); // Round this value to 2 decimal places to ensure the quartile check can find exact matches
+        r = t[i]*W - .5;
+        r = r > W-1 ? W-1 : r;
+        r = r < 0 ? 0 : r;
+        l = floor(r);
+        q[i] = expandedValue(x, w, c, idx, n, l);
+        q[i] += (r-l) * (expandedValue(x, w, c, idx, n, l+1) - q[i]);
+    }
 
-        // Check for IQR values
-        if ( isnan(lb) ) // Lower bound not found
-        {
-            if(r >= .25)
-                lb = r == .25 ? d[i] : (.25-f[i-1])/(f[i]-f[i-1]) * (d[i]-d[i-1]);
-        }
-        else // Lower bound found; search for upper bound
-        {
-            if (r >= .75)
-            {
-                ub = r == .75 ? d[i] : (.75-f[i-1])/(f[i]-f[i-1]) * (d[i]-d[i-1]);
-                break; // No use continuing
-            }
-        }
-    } 
-  
-    free(d);
-    free(f);
-    return ub-lb;
+    free(idx);
+    return q[1]-q[0];
 }
 
-// Compute standard deviation
-double std(const double x[], size_t n)
+// Compute standard deviation. 'w' holds the weight of each datum (NULL for
+// equal weights). The weighted variance is unbiased for any scale of the
+// weights: its denominator is W - sum(w.^2)/W (n-1 for equal weights).
+double std(const double x[], const double w[], size_t n)
 {
-    double ssx = 0, sxs = 0; // sum of (squared x), (sum of x) squared
+    double ssx = 0, sxs = 0, W = 0, W2 = 0; // sum of (squared x), (sum of x) squared; Sum of (squared) weights
     for(size_t i =0; i<n; i++)
     {
-        ssx += x[i] * x[i];
-        sxs += x[i];
+        double wi = w == NULL ? 1 : w[i];
+        ssx += wi * x[i] * x[i];
+        sxs += wi * x[i];
+        W   += wi;
+        W2  += wi * wi;
     }
-    return sqrt( (ssx - (sxs*sxs)/n)/(n-1) );
+    return sqrt( (ssx - (sxs*sxs)/W)/(W - W2/W) );
 }
 
 /**************************************************************************
-*                                   MEX                                   *
+*                           VECTORIZED EXP()                              *
+*                                                                         *
+* The kernel weights are computed by first filling a buffer with the      *
+* exponent of each weight, then exponentiating the buffer in place. The   *
+* exponentiation uses the widest instruction set supported by the CPU     *
+* (AVX-512, AVX2, or scalar), which is detected once at runtime, unless   *
+* another is set with krege('simd',S) (see krege_test.m).                 *
+*                                                                         *
+* exp(x) = 2^t * exp(r), where t = round(x/ln(2)) and |r| <= ln(2)/2, and *
+* exp(r) is evaluated with a truncated Taylor series:                     *
+*   EXP_FULL:   degree 12 (< 2e-16 relative error, i.e., double precision)*
+*   EXP_FAST:   degree 7  (< 1e-8 relative error)                         *
+*   EXP_SINGLE: degree 7 in single precision (< 2e-7 relative error),     *
+*               which processes twice as many values per instruction      *
 **************************************************************************/
-void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{
-    //////////////////////////////////////////////////////////////////////
-    //                          BASIC DATA HYGENE
-    ///////////////////////////////////////////////////////////////////////
-
-    // Check number of outputs
-    if (nlhs>3)
-        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 3 outputs.");
-    // Get 'x' and 'y' inputs
-    if (nrhs<2)
-        mexErrMsgIdAndTxt("kreg:inputError","Minimum two inputs required: krege(x,y)");
-    // else:
-    double* x  = mxGetPr(prhs[0]); // arg 0 --> x data
-    double* y  = mxGetPr(prhs[1]); // arg 1 --> y data
-
-    // Ensure data arrays are filled
-    if (x == NULL)
-        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'x'");
-    if (y == NULL)
-        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'y'");
+#define EXP_FULL    0   // Full double precision
+#define EXP_FAST    1   // ~1e-8 relative error
+#define EXP_SINGLE  2   // Single precision
+#define EXP_MIN     -708.0  // exp() of anything smaller is (nearly) subnormal
+#define EXP_MAX     709.0   // exp() of anything larger overflows
+#define LOG2E       1.44269504088896340736
+#define LN2_HI      6.93147180369123816490e-01 // ln(2) split into high/low parts
+#define LN2_LO      1.90821492927058770002e-10
+#define EXPF_MIN    -87.0f  // Single precision limits
+#define EXPF_MAX    88.0f
+#define LN2F_HI     0.693359375f // ln(2) split into high/low parts (single precision)
+#define LN2F_LO     -2.12194440e-4f
 
-    ///////////////////////////////////////////////////////////////////////
-    //          SORT 'X' AND 'Y' AND REMOVE NANS/INFS
-    ///////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define KREGE_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TARGET_AVX2
+        #define TARGET_AVX512
+    #else
+        #define TARGET_AVX2     __attribute__((target("avx2,fma")))
+        #define TARGET_AVX512   __attribute__((target("avx512f")))
+    #endif
+#endif
 
-    // Get size variable for data
-    size_t m = mxGetNumberOfElements(prhs[0]); // Number of (x,y) data
-    if(mxGetNumberOfElements(prhs[1]) != m) // Check for parity
-        mexErrMsgIdAndTxt("kreg:inputError","Dimension mismatch between arguments 'x' and 'y'");
+// Taylor coefficients 1/k!, k = 0, ..., 12
+static const double expCoef[13] = {
+    1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040, 1.0/40320,
+    1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600 };
+static const float expCoefF[8] = {
+    1.0f, 1.0f, 1.0f/2, 1.0f/6, 1.0f/24, 1.0f/120, 1.0f/720, 1.0f/5040 };
 
-    // Get sorted indices of 'x'
-    size_t* idx = qsortIndex(x, m);
+// Degree of the Taylor series for each accuracy mode
+static int expDegree(int mode)
+{
+    return mode == EXP_FAST ? 7 : 12;
+}
 
-    // Create sorted copies of 'x' and 'y', skipping over any 'nan' or 'inf' values
-    double* xs = malloc(m * sizeof(double));    // Sorted 'x'
-    double* ys = malloc(m * sizeof(double));    // Sorted 'y'
-    size_t i = 0, j, ex = 0; // Iterators i/j (used throughout); Number of excluded indices
-    while (i<m) {
-        j = i+ex;
-        if( isnan(x[idx[j]]) || isinf(x[idx[j]]) || isnan(y[idx[j]]) || isinf(y[idx[j]]) ) // bad values found
-        {
-            ex++; // Increment exclusions
-            m--;  // Decrement number of valid data cases. Now we do not need to
-                  // realloc(), since all subsequent steps through 'xs' or 'ys'
-                  // use for(;i<m;i++) and since 'xs' and 'yx' only contain valid
-                  // cases for indices { 0, ..., m }
-        }
-        else // Neither x_i nor y_i contain nan
-        {
-            xs[i] = x[idx[j]]; // Deep copy
-            ys[i] = y[idx[j]]; // Deep copy
-            i++;
-        }
+// Scalar exp() of a buffer; full/single precision defers to libm
+static void vexpScalar(double v[], size_t n, int mode)
+{
+    if (mode == EXP_FULL) {
+        for (size_t i = 0; i<n; i++)
+            v[i] = exp(v[i]);
+        return;
     }
-    free(idx);
-
-    // Verify that not all the data has been excluded
-    if(!i) {
-        free(xs);
-        free(ys);
-        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'x' and/or 'y'.");
-    };
-
-    ///////////////////////////////////////////////////////////////////////
-    //      SORT 'MU' (i.e., the function domain) AND REMOVE NANS/INFS
-    ///////////////////////////////////////////////////////////////////////
-    
-    double* mu; // Create pointer for potential user input of function domain
-    double* mus; // Create pointer for sorted/valid data specifying function domain
-    size_t n;
-
-    // Was domain provided?
-    if (nrhs<3) { // Omitted
-        mu = NULL;
-        n = 0;
-    } else { // Provided
-        mu = mxGetPr(prhs[2]); // Get user data
-        n = mxGetNumberOfElements(prhs[2]); // Get number of domain points       
+    if (mode == EXP_SINGLE) {
+        for (size_t i = 0; i<n; i++)
+            v[i] = expf((float)v[i]);
+        return;
     }
 
-    // Set defaults?
-    if (mu == NULL) { // Empty
-        n = (size_t)DEFAULT_LS; // Default to min/max linspace with 100 points
-        mus = linspace(getmin(xs,m),getmax(xs,m),n);
+    int deg = expDegree(mode), j;
+    double x, t, r, p;
+    for (size_t i = 0; i<n; i++)
+    {
+        x = v[i] < EXP_MIN ? EXP_MIN : (EXP_MAX < v[i] ? EXP_MAX : v[i]);
+        t = round(x * LOG2E);
+        r = (x - t*LN2_HI) - t*LN2_LO;
+        for (p = expCoef[deg], j = deg; 0<j; j--) // Horner's method
+            p = p*r + expCoef[j-1];
+        v[i] = ldexp(p, (int)t);
+    }
+}
 
-    } else if (n==1) { // Scalar
-        if ((*mu)==0 || isnan(*mu) || isinf(*mu)) // Catch bad values
-            n = (size_t)DEFAULT_LS;
-        else
-            n = (size_t)(*mu); // Default to min/max linspace with 'n' points
-        mus = linspace(getmin(xs,m),getmax(xs,m),n);
+#ifdef KREGE_X86
+// AVX2: 8 floats per iteration
+TARGET_AVX2 static void vexpAVX2F(double v[], size_t n)
+{
+    const __m256 lo = _mm256_set1_ps(EXPF_MIN), hi = _mm256_set1_ps(EXPF_MAX),
+              log2e = _mm256_set1_ps((float)LOG2E),
+              ln2hi = _mm256_set1_ps(LN2F_HI), ln2lo = _mm256_set1_ps(LN2F_LO);
+    const __m256i bias = _mm256_set1_epi32(127);
+    size_t i = 0;
+    int j;
+    __m256 x, t, r, p;
 
-    } else { // Array: sorting/data hygiene checks required
+    for (; i+8<=n; i+=8)
+    {
+        x = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(v+i+4)), _mm256_cvtpd_ps(_mm256_loadu_pd(v+i)));
+        x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+        t = _mm256_round_ps(_mm256_mul_ps(x, log2e), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm256_fnmadd_ps(t, ln2lo, _mm256_fnmadd_ps(t, ln2hi, x));
+        for (p = _mm256_set1_ps(expCoefF[7]), j = 7; 0<j; j--) // Horner's method
+            p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(expCoefF[j-1]));
 
-        // Create sorted copy of 'mu' skipping over any 'nan' or 'inf' values
-        mus = malloc(n * sizeof(double));
+        // Scale by 2^t by building the exponent bits directly
+        p = _mm256_mul_ps(p, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(t), bias), 23)));
+        _mm256_storeu_pd(v+i,   _mm256_cvtps_pd(_mm256_castps256_ps128(p)));
+        _mm256_storeu_pd(v+i+4, _mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)));
+    }
+    vexpScalar(v+i, n-i, EXP_SINGLE); // Remainder
+}
 
-        // Get sorted indices of 'mu'
-        idx = qsortIndex(mu, n);
+// AVX2: 4 doubles per iteration
+TARGET_AVX2 static void vexpAVX2(double v[], size_t n, int mode)
+{
+    if (mode == EXP_SINGLE) {
+        vexpAVX2F(v, n);
+        return;
+    }
 
-        // Copy valid cases
-        ex = 0, i = 0;
-        while (i<n) {
-            j = i+ex;
-            if( isnan(mu[idx[j]]) || isinf(mu[idx[j]]) ) { // bad values found
-                ex++; // Increment exclusions
-                n--;  // Decrement number of valid data cases
-            }
-            else // mu_i is valid
-            {
-                mus[i] = mu[idx[j]]; // deep copy
-                i++;
-            }
-        }
-        free(idx);
+    const __m256d lo = _mm256_set1_pd(EXP_MIN), hi = _mm256_set1_pd(EXP_MAX),
+               log2e = _mm256_set1_pd(LOG2E),
+               ln2hi = _mm256_set1_pd(LN2_HI), ln2lo = _mm256_set1_pd(LN2_LO);
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    int deg = expDegree(mode), j;
+    size_t i = 0;
+    __m256d x, t, r, p;
+    __m256i e;
 
-        // Verify that not all the data has been excluded
-        if(!i) {
-            free(xs);
-            free(ys);
-            free(mus);
-            mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'd'.");
-        };
-    } // else
-    
+    for (; i+4<=n; i+=4)
+    {
+        x = _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(v+i), lo), hi);
+        t = _mm256_round_pd(_mm256_mul_pd(x, log2e), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm256_fnmadd_pd(t, ln2lo, _mm256_fnmadd_pd(t, ln2hi, x));
+        for (p = _mm256_set1_pd(expCoef[deg]), j = deg; 0<j; j--) // Horner's method
+            p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(expCoef[j-1]));
 
-    ///////////////////////////////////////////////////////////////////////
-    //                      SET DEFAULT BANDWIDTH?
-    ///////////////////////////////////////////////////////////////////////
+        // Scale by 2^t by building the exponent bits directly
+        e = _mm256_slli_epi64(_mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(t)), bias), 52);
+        _mm256_storeu_pd(v+i, _mm256_mul_pd(p, _mm256_castsi256_pd(e)));
+    }
+    vexpScalar(v+i, n-i, mode); // Remainder
+}
 
-    double bw;
-    if (nrhs<4)
-        bw = nan("");
-    else
-        bw = mxGetScalar(prhs[3]); // arg 3 --> bandwidth
+// AVX-512: 16 floats per iteration
+TARGET_AVX512 static void vexpAVX512F(double v[], size_t n)
+{
+    const __m512 lo = _mm512_set1_ps(EXPF_MIN), hi = _mm512_set1_ps(EXPF_MAX),
+              log2e = _mm512_set1_ps((float)LOG2E),
+              ln2hi = _mm512_set1_ps(LN2F_HI), ln2lo = _mm512_set1_ps(LN2F_LO);
+    size_t i = 0;
+    int j;
+    __m512 x, t, r, p;
 
-    // Ensure validity of bw; set a default for invalid cases using Silverman's rule
-    if (bw<=0 || isnan(bw) || isinf(bw)) // Will catch bw<=0, bw==[], bw==NaN, bw==Inf
+    for (; i+16<=n; i+=16)
     {
-        double s = std(xs,m);
-        double I = iqr(xs,m)/1.34;
-        bw = .9 * (s < I ? s : I)  * 1.0/pow((double)m, 1.0/5);
+        x = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_loadu_pd(v+i)))),
+                                                _mm256_castps_pd(_mm512_cvtpd_ps(_mm512_loadu_pd(v+i+8))), 1));
+        x = _mm512_min_ps(_mm512_max_ps(x, lo), hi);
+        t = _mm512_roundscale_ps(_mm512_mul_ps(x, log2e), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm512_fnmadd_ps(t, ln2lo, _mm512_fnmadd_ps(t, ln2hi, x));
+        for (p = _mm512_set1_ps(expCoefF[7]), j = 7; 0<j; j--) // Horner's method
+            p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(expCoefF[j-1]));
+        p = _mm512_scalef_ps(p, t); // Scale by 2^t
+        _mm512_storeu_pd(v+i,   _mm512_cvtps_pd(_mm512_castps512_ps256(p)));
+        _mm512_storeu_pd(v+i+8, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(p), 1))));
     }
-    
-    ///////////////////////////////////////////////////////////////////////
-    //                          INITIALIZE OUTPUTS
-    //
-    //      Dynamically determine the order of outputs:
-    //          Case 1:  krege(...)
-    //                      OR
-    //                  yhat = krege(...)
-    //          Case 2: [xhat, yhat] = krege(...)
-    //          Case 3: [xhat, yhat,ehat] = krege(...)
-    ///////////////////////////////////////////////////////////////////////
-
-    // Function always returns something
-    plhs[0] = mxCreateDoubleMatrix(1, n, mxREAL);
-
-    // Allocate additional outputs, if necessary
-    for (i = 1; i<nlhs; i++)
-        plhs[i] = mxCreateDoubleMatrix(1, n, mxREAL);
-
-    // Create pointers to each potential output; default 1st output to regression
-    double *yhat = mxGetPr(plhs[0]), *xhat, *ehat;
-
-    // Domain is being returned
-    if (nlhs > 1) {
-
-        // Reassign pointer order
-        xhat = mxGetPr(plhs[0]);
-        yhat = mxGetPr(plhs[1]);
+    vexpScalar(v+i, n-i, EXP_SINGLE); // Remainder
+}
 
-        // Fill the sorted array of domain values
-        for (i = 0; i<n; i++)
-            xhat[i] = mus[i];
+// AVX-512: 8 doubles per iteration
+TARGET_AVX512 static void vexpAVX512(double v[], size_t n, int mode)
+{
+    if (mode == EXP_SINGLE) {
+        vexpAVX512F(v, n);
+        return;
     }
 
-    // Check whether error is being computed
-    bool err = nlhs==3;
-    if (err)
-        ehat = mxGetPr(plhs[2]); // Assign pointer
-
-
-
-    ///////////////////////////////////////////////////////////////////////
-    //                          REGRESSION ROUTINE
-    ///////////////////////////////////////////////////////////////////////
-
-    //////////////////
-    // STEP 1: For computational easing, find the lower/upper bounds of the data
-    //         for computing each kernel. (Limit computation to within +/- NUM_BW)
-    //         This step is poorly suited for parallelization.
-    size_t* lbIdx = malloc(n * sizeof(double)); // Indices of 'xs' and 'ys' that correspond to mu +/- NUM_BW * bw
-    size_t* ubIdx = malloc(n * sizeof(double));
-    double sigma = 2 * bw * bw, // Bandwidth converted to Gaussian sigma
-           lbVal, ubVal; // Lower/Upper bound values of 'xs' and 'ys' for i_th kernel
+    const __m512d lo = _mm512_set1_pd(EXP_MIN), hi = _mm512_set1_pd(EXP_MAX),
+               log2e = _mm512_set1_pd(LOG2E),
+               ln2hi = _mm512_set1_pd(LN2_HI), ln2lo = _mm512_set1_pd(LN2_LO);
+    int deg = expDegree(mode), j;
+    size_t i = 0;
+    __m512d x, t, r, p;
 
-    // Solve iteration one
-    i = 0;
-    ubVal = mus[i]+bw*NUM_BW;
-    lbVal = mus[i]-bw*NUM_BW;
+    for (; i+8<=n; i+=8)
+    {
+        x = _mm512_min_pd(_mm512_max_pd(_mm512_loadu_pd(v+i), lo), hi);
+        t = _mm512_roundscale_pd(_mm512_mul_pd(x, log2e), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        r = _mm512_fnmadd_pd(t, ln2lo, _mm512_fnmadd_pd(t, ln2hi, x));
+        for (p = _mm512_set1_pd(expCoef[deg]), j = deg; 0<j; j--) // Horner's method
+            p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(expCoef[j-1]));
+        _mm512_storeu_pd(v+i, _mm512_scalef_pd(p, t)); // Scale by 2^t
+    }
+    vexpScalar(v+i, n-i, mode); // Remainder
+}
+#endif
 
-    lbIdx[i] = 0; // This gives a reasonable starting location for lower bound
-    while ( (xs[lbIdx[i]] < lbVal) && (lbIdx[i] < m-1) ) // Step through data
-        lbIdx[i]++;
-    ubIdx[i] = lbIdx[i]; // This gives a reasonable starting location for upper bound
-    while ( (xs[ubIdx[i]] < ubVal) && (ubIdx[i] < m) ) // Step through data
-        ubIdx[i]++;
+// Dispatch paths of the vectorized exp(), from narrowest to widest
+typedef void (*vexpFun)(double[], size_t, int);
+enum { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512, NUM_SIMD };
+static const char* simdNames[NUM_SIMD] = { "scalar", "avx2", "avx512" };
+static int simdPath = -1; // Path set by krege('simd',S) (-1 --> widest supported)
 
-    // Solve any remaining iterations by piggy-backing off of previous values
-    for (i = 1; i<n; i++) { // Step through domain (kernels)
+// Is the instruction set of path 's' supported by this CPU (checked once)?
+bool simdSupported(int s)
+{
+    static int supported = 0; // Bit 's' is set if path 's' is supported
+    if (!supported) {
+        supported = 1 << SIMD_SCALAR;
+#ifdef KREGE_X86
+    #ifdef _MSC_VER
+        int r[4];
+        __cpuid(r, 0);
+        int nid = r[0];
+        if (7 <= nid) {
+            __cpuid(r, 1);
+            bool osxsave = (r[2] >> 27) & 1, avx = (r[2] >> 28) & 1, fma = (r[2] >> 12) & 1;
+            unsigned long long xcr = osxsave ? _xgetbv(0) : 0;
+            __cpuidex(r, 7, 0);
+            if (avx && fma && (xcr & 0x6) == 0x6 && ((r[1] >> 5) & 1))
+                supported |= 1 << SIMD_AVX2;
+            if ((xcr & 0xe6) == 0xe6 && ((r[1] >> 16) & 1))
+                supported |= 1 << SIMD_AVX512;
+        }
+    #else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            supported |= 1 << SIMD_AVX2;
+        if (__builtin_cpu_supports("avx512f"))
+            supported |= 1 << SIMD_AVX512;
+    #endif
+#endif
+    }
+    return (supported >> s) & 1;
+}
 
-        // Compute numerical limits
-        ubVal = mus[i]+bw*NUM_BW;
-        lbVal = mus[i]-bw*NUM_BW;
+// The path set by krege('simd',S), else the widest supported path
+int vexpPath(void)
+{
+    if (simdPath >= 0)
+        return simdPath;
+    int s = NUM_SIMD-1;
+    while (s > SIMD_SCALAR && !simdSupported(s))
+        s--;
+    return s;
+}
 
-        // Find indices
-        lbIdx[i] = lbIdx[i-1]; // Starting from previous value
-        while ( (xs[lbIdx[i]] < lbVal) && (lbIdx[i] < m-1) ) // Step through data
-            lbIdx[i]++;
-        ubIdx[i] = ubIdx[i-1]; // Starting from previous value
-        while ( (xs[ubIdx[i]] < ubVal) && (ubIdx[i] < m) ) // Step through data
-            ubIdx[i]++;
+// The vectorized exp() of the path in effect
+vexpFun getVexp(void)
+{
+    switch (vexpPath()) {
+#ifdef KREGE_X86
+        case SIMD_AVX512: return vexpAVX512;
+        case SIMD_AVX2:   return vexpAVX2;
+#endif
+        default:          return vexpScalar;
     }
+}
 
+/**************************************************************************
+*                              REGRESSION                                 *
+**************************************************************************/
+// First index i in [lo,hi) of the sorted array 'xs' such that xs[i] >= v
+// (or hi, if there is none)
+size_t lowerBound(const double xs[], size_t lo, size_t hi, double v)
+{
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (xs[mid] < v)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    /////////////////////
-    // STEP 2: build kernels and weight outcome variable by kernels.
-    double   f, // K(X_i-x_j)           --> kernel function (i,j): centered on X_i, weighting datum x_j
-            xh, // sum( K(X_i-x_j )     --> " summed across j
-            yh, // y_j * K(X_i-x_j)     --> regression datum y_j, weighted by kernel (i,j)
-            eh, // (yhat[i]-y_j).^2     --> SE between fitted regression (yhat_i) and datum y_j
-            diff; // Compute squared error (powers of 2) without using pow()
+// Galloping search: first index i >= start of the sorted array 'xs' such
+// that xs[i] >= v. Costs O(log(i-start)), so it is cheap when successive
+// searches are close together.
+size_t gallop(const double xs[], size_t start, size_t m, double v)
+{
+    if (start >= m || xs[start] >= v)
+        return start;
+    size_t lo = start, hi, step = 1; // Invariant: xs[lo] < v
+    while (1) {
+        hi = lo+step;
+        if (hi >= m) {
+            hi = m;
+            break;
+        }
+        if (xs[hi] >= v)
+            break;
+        lo = hi;
+        step *= 2;
+    }
+    return lowerBound(xs, lo+1, hi, v);
+}
 
-    // Open parallel section
-    long long int k; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+// Evaluate the kernel centred on 'mu' (with bandwidth 'h') at the 'w' data
+// xs[0], ..., xs[w-1], which lie within its support. The kernel is selected
+// once per call, so each kernel runs its own branch-free (vectorizable) loop.
+// Kernels are scaled to a peak of 1 (which cancels in the regression).
+// 'period' is the period of a circular 'x' (0 if linear).
+void kernelEval(int kernel, const double xs[], size_t w, double mu, double h, double period, int precision, vexpFun vexp,
+                double f[])
+{
+    double sigma = 2 * h * h, ih = 1 / h, diff; // Bandwidth converted to Gaussian sigma; Inverse bandwidth
+    double kappa = period > 0 ? period*period / (4*PI*PI*h*h) : 0, // Concentration of the von Mises kernel
+           omega = period > 0 ? 2*PI / period : 0; // Angular frequency of the period
+    size_t r;
 
-    // Utilize the maximum number of threads available
-    omp_set_num_threads(omp_get_max_threads());
-    #pragma omp parallel shared(yhat,ehat,xs,ys,mus,ubIdx,lbIdx,sigma,n) private(k,j,xh,yh,eh,f,diff)
+    switch (kernel)
     {
-        #pragma omp for schedule(static)
-        for (k = 0; k<n; k++) // Step through domain
-        {   
-            xh = 0, yh = 0, eh = 0; // Reset summation variables
-            for (j = lbIdx[k]; j<ubIdx[k]; j++) // Step through data
+        case KERN_GAUSS:  // exp( -x^2 / (2*bw^2) )
+        case KERN_PGAUSS: //   " for x >= 0 (the window excludes x < 0)
+        case KERN_NGAUSS: //   " for x <= 0 (the window excludes x > 0)
+            for (r = 0; r<w; r++)
             {
-                diff = xs[j]-mus[k];
-                f = exp( -(diff*diff) / sigma ); // kernel weight this 'x' data
-                xh += f;         // build x hat
-                yh += f * ys[j]; // build y hat
+                diff = xs[r]-mu;
+                f[r] = -(diff*diff) / sigma; // exponent of the kernel weight of this 'x' data
             }
+            vexp(f, w, precision); // kernel weight this 'x' data
+            break;
 
-            // Avoid divide by zero errors
-            #pragma omp critical
-            yhat[k] = xh > 0 ? yh / xh : 0;
+        case KERN_EXP: // exp( -x / bw ) for x >= 0
+            for (r = 0; r<w; r++)
+                f[r] = (mu-xs[r]) * ih;
+            vexp(f, w, precision);
+            break;
 
-        } // pramga omp for
+        case KERN_BEXP: // exp( -|x| / bw ) for x <= 0
+            for (r = 0; r<w; r++)
+                f[r] = (xs[r]-mu) * ih;
+            vexp(f, w, precision);
+            break;
 
-        // STEP 3: (if necessary) compute regression error
-        if (err)
-        {
-            #pragma omp for schedule(static) nowait
-            for (k = 0; k<n; k++) // Step (back) through domain
+        case KERN_TRI: // (bw - |x|) / bw for |x| <= bw
+            for (r = 0; r<w; r++)
             {
-                for (j = lbIdx[k]; j<ubIdx[k]; j++) // Step back through data
-                {
-                    diff = ys[j]-yhat[k];
-                    eh += diff * diff;  // Build ehat
-                }
+                diff = 1 - fabs(xs[r]-mu) * ih;
+                f[r] = diff > 0 ? diff : 0;
+            }
+            break;
 
-                // Avoid divide by zero errors
-                #pragma omp critical
-                ehat[k] = xh > 0 ? sqrt(eh) / xh: 0;
+        case KERN_RECT: // 1 for |x| <= bw/2
+            for (r = 0; r<w; r++)
+                f[r] = 1;
+            break;
 
-            } // pragma omp for nowait
-        } // if (err)
+        case KERN_SKEW: // Skew-normal: 2 * normpdf(x/bw) * normcdf(-SKEW_ALPHA*x/bw), scaled by sqrt(2*pi)/2
+            for (r = 0; r<w; r++)
+            {
+                diff = xs[r]-mu;
+                f[r] = -(diff*diff) / sigma;
+            }
+            vexp(f, w, precision);
+            for (r = 0; r<w; r++)
+                f[r] *= erfc( SKEW_ALPHA * (xs[r]-mu) * ih * SQRT1_2 );
+            break;
 
-    } // #pragma omp parallel
+        case KERN_VONMISES: // exp( kappa*(cos(2*pi*x/period)-1) ), kappa = (period/(2*pi*bw))^2
+            for (r = 0; r<w; r++)
+                f[r] = kappa * (cos( omega * (xs[r]-mu) ) - 1);
+            vexp(f, w, precision);
+            break;
+    }
+}
 
-    // Free any allocated arrays before exiting
+// Support of the kernel of bandwidth 'h' about 0, in units of 'x': data
+// within [lo,hi) are weighted, or [lo,hi] if this returns true. On a
+// circular 'x' (period > 0), the support is limited to one period,
+// [-period/2, period/2), so that each datum is weighted once. The von Mises
+// kernel is truncated where it falls below exp(-NUM_BW^2/2), as are the
+// unbounded kernels of 'kernels'.
+bool kernelSupport(int kernel, double h, double period, double* lo, double* hi)
+{
+    const kernelInfo* kern = kernels + kernel;
+    bool closed = kern->closed;
+    *lo = h*kern->lo;
+    *hi = h*kern->hi;
+    if (kernel == KERN_VONMISES && period > 0)
+    {
+        double c = 1 - NUM_BW*NUM_BW/2.0 * (4*PI*PI*h*h) / (period*period); // cos() of the truncation angle
+        *hi = (c <= -1 ? PI : acos(c)) / (2*PI) * period;
+        *lo = -*hi;
+    }
+    if (period > 0)
+    {
+        if (*lo < -period/2)
+            *lo = -period/2;
+        if (period/2 <= *hi) {
+            *hi = period/2;
+            closed = false;
+        }
+    }
+    return closed;
+}
+
+// STEP 1: For computational easing, find the lower/upper bounds of the data
+//         for computing each kernel. (Limit computation to the support of
+//         the kernel about each domain point; see kernelSupport())
+//         The (sorted) domain is split into one contiguous chunk per thread.
+//         Each thread binary searches for the bounds of its first domain
+//         point, then gallops forward from the previous bounds. With
+//         per-point bandwidths 'bws' (NULL for the fixed bandwidth 'bw'),
+//         a bound that moves backwards is found by binary search instead.
+void findWindows(const double xs[], size_t m, const double mus[], size_t n, double bw, const double bws[],
+                 int kernel, double period, size_t lbIdx[], size_t ubIdx[])
+{
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+              k0 = n*t/T, k1 = n*(t+1)/T, k; // This thread's chunk of the domain
+        double h, lo, hi, plo = 0, phi = 0; // Bandwidth; Window bounds (and those of the previous domain point)
+        bool closed;
+
+        for (k = k0; k<k1; k++)
+        {
+            h  = bws == NULL ? bw : bws[k];
+            closed = kernelSupport(kernel, h, period, &lo, &hi);
+            lo += mus[k];
+            hi += mus[k];
+            if (closed) // Include data on the upper bound
+                hi = nextafter(hi, INFINITY);
+            if (k == k0 || lo < plo) // Binary search
+                lbIdx[k] = lowerBound(xs, 0, m, lo);
+            else // Gallop from the previous bounds
+                lbIdx[k] = gallop(xs, lbIdx[k-1], m, lo);
+            if (k == k0 || hi < phi)
+                ubIdx[k] = lowerBound(xs, lbIdx[k], m, hi);
+            else
+                ubIdx[k] = gallop(xs, ubIdx[k-1] > lbIdx[k] ? ubIdx[k-1] : lbIdx[k], m, hi);
+            plo = lo, phi = hi;
+        }
+    }
+}
+
+// Adaptive bandwidths: twice the distance from each domain point to its
+// kn_th nearest datum (as in kreg.m). If that distance is 0, the distance to
+// the nearest datum that does not coincide with the domain point is used
+// (or 'fallback' if there is none).
+//         For sorted data, the kn nearest data of mus[k] are a contiguous
+//         run xs[a], ..., xs[a+kn-1], which only moves forward as mus[k]
+//         increases. Each thread finds the run of its first domain point by
+//         binary search, then slides it across its chunk of the domain (two
+//         pointers), so that the cost is O(n + m) with no extra memory.
+void knnBandwidth(const double xs[], size_t m, const double mus[], size_t n, size_t kn, double fallback,
+                  double bws[])
+{
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+              k0 = n*t/T, k1 = n*(t+1)/T, k, a = 0, lo, hi; // This thread's chunk of the domain; Start of the run
+        double d; // Distance to the kn_th nearest datum
+
+        for (k = k0; k<k1; k++)
+        {
+            if (k == k0) { // Binary search: the run starts no earlier than kn data before mus[k]
+                a = lowerBound(xs, 0, m, mus[k]);
+                a = a < kn ? 0 : a-kn;
+            }
+            while (a+kn < m && xs[a+kn]-mus[k] < mus[k]-xs[a]) // Slide the run forward
+                a++;
+            d = mus[k]-xs[a] > xs[a+kn-1]-mus[k] ? mus[k]-xs[a] : xs[a+kn-1]-mus[k];
+
+            if (d == 0) // The kn nearest data coincide with mus[k]
+            {
+                lo = lowerBound(xs, 0, m, mus[k]);
+                hi = lowerBound(xs, lo, m, nextafter(mus[k], INFINITY));
+                d = INFINITY;
+                if (lo > 0)
+                    d = mus[k]-xs[lo-1];
+                if (hi < m && xs[hi]-mus[k] < d)
+                    d = xs[hi]-mus[k];
+            }
+            bws[k] = isinf(d) ? fallback : 2*d;
+        }
+    }
+}
+
+// Intercept (i.e., the fitted value at u = 0) of the weighted least-squares
+// polynomial of degree 'p', given the moments S[j] = sum( w*u^j ), j = 0..2p,
+// and T[j] = sum( w*u^j*y ), j = 0..p. The normal equations are solved by
+// Gaussian elimination with partial pivoting. Windows with too few distinct
+// data for degree 'p' fall back to a lower degree.
+double localFit(const double S[], const double T[], int p)
+{
+    double A[MAX_DEGREE+1][MAX_DEGREE+2], beta[MAX_DEGREE+1], tmp;
+    int i, j, r, piv;
+
+    if (!(S[0] > 0)) // Empty window
+        return 0;
+
+    for (; p>0; p--)
+    {
+        // Augmented normal equations
+        for (i = 0; i<=p; i++) {
+            for (j = 0; j<=p; j++)
+                A[i][j] = S[i+j];
+            A[i][p+1] = T[i];
+        }
+
+        // Forward elimination
+        for (j = 0; j<=p; j++)
+        {
+            for (piv = j, r = j+1; r<=p; r++)
+                if (fabs(A[piv][j]) < fabs(A[r][j]))
+                    piv = r;
+            if (fabs(A[piv][j]) <= 1e-10*S[0]) // (Near) singular
+                break;
+            for (i = j; i<=p+1; i++)
+                tmp = A[j][i], A[j][i] = A[piv][i], A[piv][i] = tmp;
+            for (r = j+1; r<=p; r++)
+                for (tmp = A[r][j]/A[j][j], i = j; i<=p+1; i++)
+                    A[r][i] -= tmp * A[j][i];
+        }
+        if (j<=p)
+            continue; // Try a lower degree
+
+        // Back substitution
+        for (j = p; j>=0; j--) {
+            for (tmp = A[j][p+1], i = j+1; i<=p; i++)
+                tmp -= A[j][i] * beta[i];
+            beta[j] = tmp / A[j][j];
+        }
+        return beta[0];
+    }
+    return T[0] / S[0]; // Local constant
+}
+
+// Apply the schedule of this call to the schedule(runtime) loops of the
+// enclosing parallel region. It is set in the implicit task of each thread
+// of the region, so it ends with the region.
+void runSchedule(void)
+{
+#if _OPENMP >= 200805 // omp_set_schedule() requires OpenMP 3.0
+    omp_set_schedule(loopSchedule == SCHED_DYNAMIC ? omp_sched_dynamic : loopSchedule == SCHED_GUIDED ? omp_sched_guided : omp_sched_static,
+                     loopSchedule == SCHED_STATIC ? 0 : SCHED_CHUNK);
+#endif
+}
+
+// STEP 2: build kernels and weight outcome variable by kernels.
+//         The kernel weights of the k_th domain point are computed once
+//         into a buffer, then applied to every column of 'y'. Columns are
+//         processed in blocks of COL_BLOCK so that the accumulators and the
+//         active slab of 'ys' remain cache-resident.
+//         If 'wts' is not NULL, the kernel weights of the k_th domain point
+//         were precomputed (see makePlan()) and start at wts[off[k]].
+//         For 'degree' > 0, the running sums are the weighted moments of
+//         u = (x-mu)/bw (and of u*y), which give the local polynomial fit.
+//         If 'cw' is not NULL, the kernel weight of datum j is multiplied by
+//         cw[j] (e.g., bootstrap counts), and empty windows return NaN.
+//         If 'vs' is not NULL, the kernel weight of datum j in column c is
+//         also multiplied by vs[j*K+c]: 0 masks an invalid value, and
+//         other values are robustness weights (see robustWeights()).
+//         The domain is shared by the threads with the schedule set by
+//         useThreads(), since windows of uneven sizes (e.g., 'knn', or
+//         clustered data) make a static schedule uneven. If 'serial', the
+//         domain is fitted by the calling thread alone (e.g., within a
+//         parallel loop over bootstrap replicates), whether or not nested
+//         parallelism is enabled.
+// STEP 3: (if 'ehat' is not NULL) compute regression error
+void kernelRegression(const double xs[], const double ys[], const double vs[], const double cw[], size_t K,
+                      const double mus[], size_t n, double bw, const double bws[], int kernel, double period, int degree,
+                      const size_t lbIdx[], const size_t ubIdx[], const double wts[], const size_t off[],
+                      int precision, vexpFun vexp, bool serial, double yhat[], double ehat[])
+{
+    bool err = ehat != NULL;    // Compute regression error?
+    double empty = cw == NULL ? 0 : NAN; // Regression of an empty window
+    size_t i, c;
+
+    // Find the widest window, which sizes the per-thread kernel buffer
+    size_t maxWin = 1;
+    for (i = 0; i<n; i++)
+        if (ubIdx[i] > lbIdx[i] && maxWin < ubIdx[i]-lbIdx[i])
+            maxWin = ubIdx[i]-lbIdx[i];
+
+    // Open parallel section
+    long long int k; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    // The number of threads and the schedule are set by useThreads()
+    #pragma omp parallel shared(yhat,ehat,xs,ys,vs,mus,ubIdx,lbIdx,wts,off,cw,empty,bw,bws,n,K,maxWin,vexp,precision,kernel,period,degree) private(k,c) num_threads(numThreads) if(!serial)
+    {
+        double   *f = wts == NULL || cw != NULL ? malloc(maxWin * sizeof(double)) : NULL, // K(X_i-x_j)  --> kernel function (i,j): centered on X_i, weighting datum x_j
+                *xh = malloc(K * sizeof(double)),      // sum( K(X_i-x_j) ) --> " summed across j (per column of 'y')
+                *yh = malloc(K * sizeof(double)),      // sum( y_j * K(X_i-x_j) ) --> regression datum y_j, weighted by kernel (i,j)
+                 *S = degree ? malloc(K * NUM_MOM * sizeof(double)) : NULL, // sum( K(X_i-x_j) * u_j^p ) --> weighted moments (per column of 'y')
+                 *T = degree ? malloc(K * NUM_MOM * sizeof(double)) : NULL, // sum( K(X_i-x_j) * u_j^p * y_j )
+                 pw[NUM_MOM], // K(X_i-x_j) * u_j^p
+              u, // u_j = (x_j-X_i)/bw
+              h, // Bandwidth of the k_th domain point
+              diff, // Compute squared error (powers of 2) without using pow()
+              kw; // Kernel weight of one value of 'y', times its weight in 'vs'
+        const double *row, *vrow, *fk; // Pointer to the j_th row of 'ys' (or 'vs'); Kernel weights of the k_th domain point
+        size_t c0, c1, w, r; // Column block bounds; Window size; Window iterator
+        int p; // Moment iterator
+
+        runSchedule();
+        #pragma omp for schedule(runtime)
+        for (k = 0; k<n; k++) // Step through domain
+        {
+            // Build the kernel once for this domain point (unless precomputed)
+            h = bws == NULL ? bw : bws[k];
+            w = ubIdx[k] > lbIdx[k] ? ubIdx[k]-lbIdx[k] : 0;
+            if (wts != NULL)
+                fk = wts + off[k];
+            else
+            {
+                kernelEval(kernel, xs+lbIdx[k], w, mus[k], h, period, precision, vexp, f);
+                fk = f;
+            }
+            if (cw != NULL) // Weight the data
+            {
+                for (r = 0; r<w; r++)
+                    f[r] = fk[r] * cw[lbIdx[k]+r];
+                fk = f;
+            }
+
+            // Apply the kernel to each column of 'y', one block of columns at a time
+            for (c0 = 0; c0<K; c0 = c1)
+            {
+                c1 = c0+COL_BLOCK < K ? c0+COL_BLOCK : K;
+                if (degree > 0) // Local polynomial: weighted least-squares fit around mus[k]
+                {
+                    for (c = c0; c<c1; c++) // Reset summation variables
+                        for (p = 0; p<NUM_MOM; p++)
+                            S[c*NUM_MOM+p] = 0, T[c*NUM_MOM+p] = 0;
+
+                    for (r = 0; r<w; r++) // Step through data
+                    {
+                        u = (xs[lbIdx[k]+r]-mus[k]) / h;
+                        for (pw[0] = fk[r], p = 1; p<=2*degree; p++)
+                            pw[p] = pw[p-1] * u;
+                        row  = ys + (lbIdx[k]+r)*K;
+                        vrow = vs == NULL ? NULL : vs + (lbIdx[k]+r)*K;
+                        if (vrow == NULL) // Every column shares the moments of column c0
+                        {
+                            for (c = c0; c<c1; c++)
+                                for (p = 0; p<=degree; p++)
+                                    T[c*NUM_MOM+p] += pw[p] * row[c];
+                            for (p = 0; p<=2*degree; p++)
+                                S[c0*NUM_MOM+p] += pw[p];
+                        }
+                        else // Each column has its own weights
+                        {
+                            for (c = c0; c<c1; c++)
+                            {
+                                if (vrow[c] == 0) // Masked value
+                                    continue;
+                                for (p = 0; p<=degree; p++)
+                                    T[c*NUM_MOM+p] += vrow[c] * pw[p] * row[c];
+                                for (p = 0; p<=2*degree; p++)
+                                    S[c*NUM_MOM+p] += vrow[c] * pw[p];
+                            }
+                        }
+                    }
+
+                    for (c = c0; c<c1; c++)
+                    {
+                        const double* Sc = S + (vs == NULL ? c0 : c)*NUM_MOM;
+                        xh[c] = Sc[0];
+                        yhat[k+c*n] = xh[c] > 0 ? localFit(Sc, T + c*NUM_MOM, degree) : empty;
+                    }
+                }
+                else // Local constant (Nadaraya-Watson)
+                {
+                    for (c = c0; c<c1; c++) // Reset summation variables
+                        xh[c] = 0, yh[c] = 0;
+
+                    if (vs == NULL) // Every column shares the same kernel sum
+                    {
+                        for (r = 0; r<w; r++) // Step through data
+                        {
+                            row = ys + (lbIdx[k]+r)*K;
+                            for (c = c0; c<c1; c++)
+                                yh[c] += fk[r] * row[c]; // build y hat
+                        }
+                        for (r = 0, xh[c0] = 0; r<w; r++)
+                            xh[c0] += fk[r]; // build x hat
+                        for (c = c0+1; c<c1; c++)
+                            xh[c] = xh[c0];
+                    }
+                    else // Weighted (or masked) values of each column
+                    {
+                        for (r = 0; r<w; r++)
+                        {
+                            row  = ys + (lbIdx[k]+r)*K;
+                            vrow = vs + (lbIdx[k]+r)*K;
+                            for (c = c0; c<c1; c++)
+                            {
+                                kw = fk[r] * vrow[c];
+                                xh[c] += kw;          // build x hat
+                                yh[c] += kw * row[c]; // build y hat
+                            }
+                        }
+                    }
+
+                    // Avoid divide by zero errors
+                    for (c = c0; c<c1; c++)
+                        yhat[k+c*n] = xh[c] > 0 ? yh[c] / xh[c] : empty;
+                }
+
+                // STEP 3: (if necessary) compute regression error
+                if (err)
+                {
+                    for (c = c0; c<c1; c++) // Reset summation variables
+                        yh[c] = 0;
+                    for (r = 0; r<w; r++) // Step back through data
+                    {
+                        row = ys + (lbIdx[k]+r)*K;
+                        for (c = c0; c<c1; c++)
+                        {
+                            diff = row[c]-yhat[k+c*n];
+                            yh[c] += (vs == NULL ? 1 : vs[(lbIdx[k]+r)*K+c]) * diff * diff; // Build ehat
+                        }
+                    }
+
+                    // Avoid divide by zero errors
+                    for (c = c0; c<c1; c++)
+                        ehat[k+c*n] = xh[c] > 0 ? sqrt(yh[c]) / xh[c] : 0;
+                }
+            } // for (c0)
+
+        } // pragma omp for
+
+        free(f);
+        free(xh);
+        free(yh);
+        free(S);
+        free(T);
+
+    } // #pragma omp parallel
+
+}
+
+// Precompute the kernel weights of every domain point. The weights of the
+// k_th domain point are stored in wts[off[k]], ..., wts[off[k+1]-1].
+void kernelWeights(const double xs[], const double mus[], size_t n, double bw, const double bws[], int kernel, double period,
+                   const size_t lbIdx[], const size_t off[], int precision, vexpFun vexp, double wts[])
+{
+    long long int k; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        runSchedule();
+        #pragma omp for schedule(runtime)
+        for (k = 0; k<(long long int)n; k++) // Step through domain
+        {
+            kernelEval(kernel, xs+lbIdx[k], off[k+1]-off[k], mus[k], bws == NULL ? bw : bws[k], period, precision, vexp,
+                       wts+off[k]);
+        }
+    }
+}
+
+// Sum of binned values at grid offsets [-hi,-lo] and [lo,hi] around grid point
+// g (or [-hi,hi] when lo is 0), from the (G+1 x K) prefix sums 'P' of column c
+double boxSum(const double P[], size_t G, size_t K, size_t c, size_t g, size_t lo, size_t hi)
+{
+    size_t a = g < hi ? 0 : g-hi,       // Left segment [a, b)
+           b = g+1 < lo ? 0 : g+1-lo,
+           d = g+hi+1 < G ? g+hi+1 : G, // Right segment [e, d)
+           e = g+lo < G ? g+lo : G;
+    if (!lo)
+        return P[d*K+c] - P[a*K+c];
+    return (b > a ? P[b*K+c] - P[a*K+c] : 0) + (d > e ? P[d*K+c] - P[e*K+c] : 0);
+}
+
+// Binned approximation of STEP 1-3: O(m + G*L) rather than O(m*window).
+//   1) Linearly bin the (unsorted) data onto a grid of G equally spaced
+//      points, accumulating the sums of 1, y, and y^2 of each column.
+//   2) Convolve the binned sums with the Gaussian kernel, truncated at
+//      +/- NUM_BW bandwidths (L grid points), and with a rectangular window
+//      of the same width (for the regression error).
+//   3) Linearly interpolate the smoothed sums onto the domain.
+// Returns the bound, per unit kernel weight, on the error of the binned
+// kernel weights. Each datum's kernel weight is linearly interpolated
+// twice (onto the grid, then onto the domain), which each contribute at
+// most (delta^2/8)*max|K''| = delta^2/(8*bw^2). If 'ebound' is not NULL,
+// this is propagated to a first-order bound on the error of each 'yhat':
+//   |yhat' - yhat| <= eps * sum|y_j - yhat| / sum(K) <= eps * sqrt(N*SSE) / sum(K)
+// plus the same term for data near the kernel truncation (see STEP 3).
+double binnedRegression(const double xs[], const double ys[], const double vs[], size_t m, size_t K,
+                        const double mus[], size_t n, double bw, size_t G, vexpFun vexp,
+                        double yhat[], double ehat[], double ebound[])
+{
+    // Grid spans both the data and the domain
+    double lo = getmin(xs, m), hi = getmax(xs, m);
+    lo = mus[0] < lo ? mus[0] : lo;
+    hi = hi < mus[n-1] ? mus[n-1] : hi;
+    double delta = hi > lo ? (hi-lo)/(double)(G-1) : bw > 0 ? bw : 1,
+           hw = ceil(NUM_BW*bw/delta); // Kernel half-width in grid points
+    size_t L = hw < (double)G ? (size_t)hw : G-1; // (clamped before the cast)
+
+    // STEP 1: Linear binning. Bins are row-major (G x K) like 'ys'.
+    // Each thread bins a contiguous chunk of the data into private bins.
+    size_t GK = G*K, g;
+    double *S0 = calloc(GK, sizeof(double)), // sum of weights (per column, since values may be masked)
+           *S1 = calloc(GK, sizeof(double)), // sum of y
+           *S2 = calloc(GK, sizeof(double)); // sum of y^2
+    long long int t;
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        double *b0 = calloc(GK, sizeof(double)), *b1 = calloc(GK, sizeof(double)), *b2 = calloc(GK, sizeof(double)),
+               p, f, v, y;
+        size_t l, cc;
+
+        #pragma omp for schedule(static)
+        for (t = 0; t<(long long int)m; t++)
+        {
+            p = (xs[t]-lo)/delta;
+            l = (size_t)p;
+            if (G-2 < l)
+                l = G-2;
+            f = p-(double)l; // Fraction of the datum assigned to bin l+1
+            for (cc = 0; cc<K; cc++)
+            {
+                v = vs == NULL ? 1 : vs[t*K+cc];
+                y = ys[t*K+cc];
+                b0[l*K+cc] += (1-f)*v, b0[(l+1)*K+cc] += f*v;
+                b1[l*K+cc] += (1-f)*v*y, b1[(l+1)*K+cc] += f*v*y;
+                b2[l*K+cc] += (1-f)*v*y*y, b2[(l+1)*K+cc] += f*v*y*y;
+            }
+        }
+
+        // Merge private bins
+        #pragma omp critical
+        for (l = 0; l<GK; l++) {
+            S0[l] += b0[l];
+            S1[l] += b1[l];
+            S2[l] += b2[l];
+        }
+        free(b0);
+        free(b1);
+        free(b2);
+    }
+
+    // STEP 2: Truncated convolution with the kernel (and rectangular window)
+    double* kern = malloc((L+1) * sizeof(double));
+    for (g = 0; g<=L; g++)
+        kern[g] = -((double)g*delta)*((double)g*delta) / (2*bw*bw);
+    vexp(kern, L+1, EXP_FULL);
+
+    double *T0 = calloc(GK, sizeof(double)), // Kernel-weighted sums
+           *T1 = calloc(GK, sizeof(double));
+
+    #pragma omp parallel for schedule(static) num_threads(numThreads)
+    for (t = 0; t<(long long int)G; t++)
+    {
+        size_t a = (size_t)t < L ? 0 : (size_t)t-L,
+               b = (size_t)t+L < G ? (size_t)t+L : G-1, l, cc;
+        double kk;
+        for (l = a; l<=b; l++)
+        {
+            kk = kern[l < (size_t)t ? (size_t)t-l : l-(size_t)t];
+            for (cc = 0; cc<K; cc++)
+            {
+                T0[t*K+cc] += kk * S0[l*K+cc];
+                T1[t*K+cc] += kk * S1[l*K+cc];
+            }
+        }
+    }
+
+    // Prefix sums of the binned sums give any rectangular window sum in O(1)
+    double *P[3] = { malloc((GK+K) * sizeof(double)), malloc((GK+K) * sizeof(double)), malloc((GK+K) * sizeof(double)) };
+    for (size_t cc = 0; cc<K; cc++)
+    {
+        P[0][cc] = 0, P[1][cc] = 0, P[2][cc] = 0;
+        for (g = 0; g<G; g++) {
+            P[0][(g+1)*K+cc] = P[0][g*K+cc] + S0[g*K+cc];
+            P[1][(g+1)*K+cc] = P[1][g*K+cc] + S1[g*K+cc];
+            P[2][(g+1)*K+cc] = P[2][g*K+cc] + S2[g*K+cc];
+        }
+    }
+
+    // STEP 3: Interpolate onto the domain.
+    // Besides the binning error, data within a few grid points of the
+    // kernel truncation (+/- NUM_BW bandwidths) may be included by one
+    // method and excluded by the other. Their weight is at most 'kcut'.
+    double eps = delta*delta / (4*bw*bw),
+          kcut = L > 4 ? exp( -((L-4)*delta)*((L-4)*delta) / (2*bw*bw) ) : 1;
+    size_t inner = L > 3 ? L-3 : 0, outer = L+3; // Grid offsets of the truncation band
+
+    #pragma omp parallel for schedule(static) num_threads(numThreads)
+    for (t = 0; t<(long long int)n; t++)
+    {
+        double p = (mus[t]-lo)/delta, f, a0, a1, r[3], b[3], sse, bse, yh;
+        size_t l, cc, q;
+        p = p < 0 ? 0 : p;
+        l = (size_t)p;
+        if (G-2 < l)
+            l = G-2;
+        f = p-(double)l;
+        for (cc = 0; cc<K; cc++)
+        {
+            a0 = (1-f)*T0[l*K+cc] + f*T0[(l+1)*K+cc];
+            a1 = (1-f)*T1[l*K+cc] + f*T1[(l+1)*K+cc];
+            yh = yhat[t+cc*n] = a0 > 0 ? a1 / a0 : 0;
+
+            if (ehat == NULL && ebound == NULL)
+                continue;
+
+            // Window (r) and truncation band (b) sums of 1, y, y^2
+            for (q = 0; q<3; q++) {
+                r[q] = (1-f)*boxSum(P[q], G, K, cc, l, 0, L) + f*boxSum(P[q], G, K, cc, l+1, 0, L);
+                b[q] = (1-f)*boxSum(P[q], G, K, cc, l, inner, outer) + f*boxSum(P[q], G, K, cc, l+1, inner, outer);
+            }
+            sse = r[2] - 2*yh*r[1] + r[0]*yh*yh;
+            sse = sse > 0 ? sse : 0;
+            bse = b[2] - 2*yh*b[1] + b[0]*yh*yh;
+            bse = bse > 0 ? bse : 0;
+            if (ehat != NULL)
+                ehat[t+cc*n] = a0 > 0 ? sqrt(sse) / a0 : 0;
+            if (ebound != NULL)
+                ebound[t+cc*n] = a0 > 0 ? (eps * sqrt(r[0]*sse) + kcut * sqrt(b[0]*bse)) / a0 : 0;
+        }
+    }
+
+    free(S0);
+    free(S1);
+    free(S2);
+    free(kern);
+    free(T0);
+    free(T1);
+    free(P[0]);
+    free(P[1]);
+    free(P[2]);
+
+    return eps;
+}
+
+/**************************************************************************
+*                     LEAVE-ONE-OUT CROSS-VALIDATION                      *
+**************************************************************************/
+// Compute the leave-one-out prediction error of each bandwidth in 'grid'.
+// Each bandwidth is evaluated in one pass over the sorted data: the kernel
+// window of datum i is found by sliding the window of datum i-1, and the
+// leave-one-out fit is the full kernel sum with datum i's own weight
+// removed. Bandwidths are distributed across threads. For 'degree' > 0,
+// datum i only contributes to the zeroth moments (u = 0). With observation
+// weights in 'vs', the squared errors are weighted means.
+void cvError(const double xs[], const double ys[], const double vs[], size_t m, size_t K,
+             const double grid[], size_t G, int kernel, int degree, int precision, vexpFun vexp, double cverr[])
+{
+    const kernelInfo* kern = kernels + kernel;
+    long long int g; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    #pragma omp parallel for schedule(dynamic,1) num_threads(numThreads)
+    for (g = 0; g<(long long int)G; g++) // Step through bandwidths
+    {
+        double h = grid[g], diff, v, xh, yh, sse = 0, cnt = 0, *f = NULL, fi, wi,
+               S[NUM_MOM], T[NUM_MOM], pw[NUM_MOM], u;
+        size_t i, c, r, w, lb = 0, ub = 0, cap = 0;
+        int p;
+
+        for (i = 0; i<m; i++) // Step through data
+        {
+            // Slide the window to the support of the kernel about x_i
+            while (lb < m && xs[lb] < xs[i]+h*kern->lo)
+                lb++;
+            while (ub < m && (kern->closed ? xs[ub] <= xs[i]+h*kern->hi : xs[ub] < xs[i]+h*kern->hi))
+                ub++;
+            if (ub <= i) // Window always contains datum i
+                ub = i+1;
+
+            // Build the kernel once for this datum
+            w = ub-lb;
+            if (cap < w) {
+                free(f);
+                f = malloc((cap = 2*w) * sizeof(double));
+            }
+            kernelEval(kernel, xs+lb, w, xs[i], h, 0, precision, vexp, f);
+            fi = f[i-lb]; // Weight of datum i
+
+            // Leave-one-out fit of each column
+            for (c = 0; c<K; c++)
+            {
+                wi = vs == NULL ? 1 : vs[i*K+c]; // Weight of datum i
+                if (!wi) // Masked value
+                    continue;
+                if (degree > 0) // Local polynomial
+                {
+                    for (p = 0; p<NUM_MOM; p++)
+                        S[p] = 0, T[p] = 0;
+                    for (r = 0; r<w; r++)
+                    {
+                        u = (xs[lb+r]-xs[i]) / h;
+                        v = vs == NULL ? f[r] : f[r] * vs[(lb+r)*K+c];
+                        for (pw[0] = v, p = 1; p<=2*degree; p++)
+                            pw[p] = pw[p-1] * u;
+                        for (p = 0; p<=2*degree; p++)
+                            S[p] += pw[p];
+                        for (p = 0; p<=degree; p++)
+                            T[p] += pw[p] * ys[(lb+r)*K+c];
+                    }
+                    S[0] -= fi * wi; // Remove datum i
+                    T[0] -= fi * wi * ys[i*K+c];
+                    xh = S[0];
+                    yh = xh > 1e-12 * (xh + fi*wi) ? localFit(S, T, degree) * xh : 0;
+                }
+                else // Local constant
+                {
+                    for (xh = 0, yh = 0, r = 0; r<w; r++)
+                    {
+                        v = vs == NULL ? f[r] : f[r] * vs[(lb+r)*K+c];
+                        xh += v;
+                        yh += v * ys[(lb+r)*K+c];
+                    }
+                    xh -= fi * wi; // Remove datum i
+                    yh -= fi * wi * ys[i*K+c];
+                }
+                // Skip data with no neighbours (relative to the kernel sum
+                // before datum i was removed, which scales with the weights)
+                if (xh > 1e-12 * (xh + fi*wi)) {
+                    diff = ys[i*K+c] - yh/xh;
+                    sse += wi * diff*diff;
+                    cnt += wi;
+                }
+            }
+        }
+        free(f);
+
+        cverr[g] = cnt > 0 ? sse/cnt : INFINITY;
+    }
+}
+
+/**************************************************************************
+*                                BOOTSTRAP                                *
+**************************************************************************/
+// Counter-based random numbers: the output function of SplitMix64. The j_th
+// draw of replicate b is mix64(stream_b + (j+1)*GOLDEN), which depends only
+// on (seed, b, j). Thus, every replicate has its own stream, and the
+// resamples do not depend on the number of threads or the order in which
+// the replicates are run.
+#define GOLDEN 0x9E3779B97F4A7C15ULL
+uint64_t mix64(uint64_t z)
+{
+    z += GOLDEN;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Define comparison function for qsort operating on double arrays
+int compDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile 'p' (in [0,1]) of the sorted array 'v', as MATLAB's prctile():
+// v[i] is the (i+0.5)/n quantile, with linear interpolation in between
+double percentile(const double v[], size_t n, double p)
+{
+    if (!n)
+        return NAN;
+    double r = p*(double)n - .5;
+    if (r <= 0)
+        return v[0];
+    if (r >= (double)(n-1))
+        return v[n-1];
+    size_t i = (size_t)r;
+    return v[i] + (r-(double)i)*(v[i+1]-v[i]);
+}
+
+// Pointwise percentile bootstrap bands of the regression. Each of the 'B'
+// replicates resamples the m (x,y) pairs with replacement, which is stored
+// as the multinomial counts 'cw' that multiply the kernel weights, and
+// refits the regression (with the same bandwidth, kernel and degree).
+// Replicates are distributed across threads, and each thread fits its
+// replicates serially. The kernel weights are shared by every replicate,
+// so they are computed once (if there are no more than BOOT_WTS).
+// 'lo' and 'hi' are the alpha/2 and 1-alpha/2 percentiles of the replicates
+// at each domain point (excluding replicates with no data in the window).
+// On a circular 'x', the first 'nl' and last 'nr' of the m data are copies
+// wrapped around the ends of the period (see wrapData()), which share the
+// counts of the data they copy.
+void bootstrap(const double xs[], const double ys[], const double vs[], size_t m, size_t nl, size_t nr, size_t K,
+               const double mus[], size_t n, double bw, const double bws[], int kernel, double period, int degree,
+               const size_t lbIdx[], const size_t ubIdx[], int precision, vexpFun vexp,
+               size_t B, double alpha, uint64_t seed, double lo[], double hi[])
+{
+    size_t N = n*K, q;
+    long long int b; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    // Precompute the kernel weights?
+    size_t* off = malloc((n+1) * sizeof(size_t));
+    double* wts = NULL;
+    for (off[0] = 0, q = 0; q<n; q++)
+        off[q+1] = off[q] + (ubIdx[q] > lbIdx[q] ? ubIdx[q]-lbIdx[q] : 0);
+    if (off[n] <= BOOT_WTS) {
+        wts = malloc(off[n] * sizeof(double));
+        kernelWeights(xs, mus, n, bw, bws, kernel, period, lbIdx, off, precision, vexp, wts);
+    }
+
+    // Replicate curves; the B replicates of each point are contiguous
+    double* reps = malloc(N * B * sizeof(double));
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        double *cw = malloc(m * sizeof(double)), // Bootstrap counts of each datum
+               *yb = malloc(N * sizeof(double)); // Regression of one replicate
+        uint64_t stream;
+        size_t j, mr = m-nl-nr; // Number of (unwrapped) data
+
+        #pragma omp for schedule(dynamic,1)
+        for (b = 0; b<(long long int)B; b++)
+        {
+            // Resample
+            memset(cw, 0, m * sizeof(double));
+            stream = mix64(seed + mix64((uint64_t)b));
+            for (j = 0; j<mr; j++) {
+                size_t d = (size_t)((double)(mix64(stream + (j+1)*GOLDEN) >> 11) * (1.0/9007199254740992.0) * (double)mr);
+                cw[nl + (d < mr ? d : mr-1)] += 1;
+            }
+            for (j = 0; j<nl; j++) // Wrapped copies of the last/first data
+                cw[j] = cw[mr+j];
+            for (j = 0; j<nr; j++)
+                cw[nl+mr+j] = cw[nl+j];
+
+            // Refit (within this thread)
+            kernelRegression(xs, ys, vs, cw, K, mus, n, bw, bws, kernel, period, degree, lbIdx, ubIdx,
+                             wts, wts == NULL ? NULL : off, precision, vexp, true, yb, NULL);
+            for (j = 0; j<N; j++)
+                reps[j*B+b] = yb[j];
+        }
+        free(cw);
+        free(yb);
+    }
+    free(off);
+    free(wts);
+
+    // Percentiles of each point
+    #pragma omp parallel for schedule(static) num_threads(numThreads)
+    for (b = 0; b<(long long int)N; b++)
+    {
+        double* v = reps + b*B;
+        size_t i, nv;
+        for (nv = 0, i = 0; i<B; i++) // Drop empty replicates
+            if (!isnan(v[i]))
+                v[nv++] = v[i];
+        qsort(v, nv, sizeof(double), compDouble);
+        lo[b] = percentile(v, nv, alpha/2);
+        hi[b] = percentile(v, nv, 1-alpha/2);
+    }
+    free(reps);
+}
+
+/**************************************************************************
+*                          ROBUST REWEIGHTING                             *
+**************************************************************************/
+// The k_th smallest of the 'n' values of 'v' (which are reordered), by
+// quickselect in O(n) expected time
+double nthValue(double v[], size_t n, size_t k)
+{
+    long long int lo = 0, hi = (long long int)n-1, i, j, kk = (long long int)k;
+    double pivot, tmp;
+    while (lo < hi)
+    {
+        pivot = v[lo + (hi-lo)/2];
+        for (i = lo, j = hi; i <= j; ) // Hoare partition
+        {
+            while (v[i] < pivot)
+                i++;
+            while (pivot < v[j])
+                j--;
+            if (i <= j) {
+                tmp = v[i], v[i] = v[j], v[j] = tmp;
+                i++, j--;
+            }
+        }
+        if (kk <= j) // v[lo..j] <= pivot <= v[i..hi]
+            hi = j;
+        else if (i <= kk)
+            lo = i;
+        else // v[k] == pivot
+            break;
+    }
+    return v[k];
+}
+
+// Median of the 'n' values of 'v' (which are reordered)
+double median(double v[], size_t n)
+{
+    double hi = nthValue(v, n, n/2), lo;
+    if (n % 2)
+        return hi;
+    for (lo = v[0], n /= 2; n-- > 1; ) // Largest value of the lower half
+        lo = lo < v[n] ? v[n] : lo;
+    return (lo + hi) / 2;
+}
+
+// Robustness weights of LOWESS (Cleveland, 1979). Each of the 'iters' passes
+// fits the regression at every datum, using the windows and kernel of the
+// domain, and sets the weight of each value of 'y' to the bisquare
+// (1-u^2)^2 of its scaled residual u = r/(6*s), where 's' is the median
+// absolute residual of its column (0 if |u| >= 1). The passes reuse the
+// sorted data, the windows of the data are found once, and each pass is
+// computed in parallel. The weights (times the validity mask 'vs') are
+// returned as a new (row-major) array of the m data. The first 'nl' and last
+// 'nr' data are copies wrapped around a circular 'x' (see wrapData()), which
+// share the weights of the data they copy.
+double* robustWeights(const double xs[], const double ys[], const double vs[], size_t m, size_t nl, size_t nr, size_t K,
+                      double bw, size_t knn, int kernel, double period, int degree, int precision, vexpFun vexp,
+                      size_t iters)
+{
+    size_t mr = m-nl-nr, i, it; // Number of (unwrapped) data
+    const double* xd = xs+nl;   // The (unwrapped) data
+    size_t *lbIdx = malloc(mr * sizeof(size_t)), *ubIdx = malloc(mr * sizeof(size_t));
+    double *rw  = malloc(m * K * sizeof(double)), // Robustness weights
+           *fit = malloc(mr * K * sizeof(double)), // Regression at the data
+           *bws = NULL;
+    long long int c; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    // Windows (and adaptive bandwidths) of the data
+    if (knn) {
+        bws = malloc(mr * sizeof(double));
+        knnBandwidth(xs, m, xd, mr, knn, bw, bws);
+    }
+    findWindows(xs, m, xd, mr, bw, bws, kernel, period, lbIdx, ubIdx);
+
+    for (i = 0; i<m*K; i++)
+        rw[i] = vs == NULL ? 1 : vs[i];
+    for (it = 0; it<iters; it++)
+    {
+        kernelRegression(xs, ys, rw, NULL, K, xd, mr, bw, bws, kernel, period, degree, lbIdx, ubIdx,
+                         NULL, NULL, precision, vexp, false, fit, NULL);
+
+        // Bisquare weights of the residuals of each column
+        #pragma omp parallel for schedule(dynamic,1) private(i) num_threads(numThreads)
+        for (c = 0; c<(long long int)K; c++)
+        {
+            double *res = malloc(mr * sizeof(double)), s, u;
+            size_t nv = 0, j;
+            for (i = 0; i<mr; i++) {
+                j = (nl+i)*K+c;
+                if (vs == NULL || vs[j] != 0)
+                    res[nv++] = fabs(ys[j] - fit[i+c*mr]);
+            }
+            s = nv ? 6 * median(res, nv) : 0;
+            for (i = 0; i<mr; i++) {
+                j = (nl+i)*K+c;
+                u = s > 0 ? (ys[j] - fit[i+c*mr]) / s : 0; // Every residual is kept if most are 0
+                rw[j] = (vs == NULL ? 1 : vs[j]) * (fabs(u) < 1 ? (1-u*u)*(1-u*u) : 0);
+            }
+            free(res);
+        }
+
+        // Wrapped copies of the last/first data
+        memcpy(rw, rw + mr*K, nl * K * sizeof(double));
+        memcpy(rw + (nl+mr)*K, rw + nl*K, nr * K * sizeof(double));
+    }
+
+    free(lbIdx);
+    free(ubIdx);
+    free(fit);
+    free(bws);
+    return rw;
+}
+
+/**************************************************************************
+*                          QUANTILE REGRESSION                            *
+**************************************************************************/
+// Update the values of one column of 'y' in the window [plb,pub), sorted by
+// value in 'cur' (nc entries), to those of the window [lb,ub). The data that
+// left the window are filtered out, and the data that entered are sorted and
+// merged in, so sliding the window by d data costs O(w + d*log(d)) rather
+// than sorting the w data of the window. Masked values (vs == 0) are never
+// entered. Returns the number of values in the new window. Both 'cur' and
+// 'tmp' hold as many values as the widest window.
+size_t slideWindow(const double ys[], const double vs[], size_t K, size_t c, size_t plb, size_t pub,
+                   size_t lb, size_t ub, iarray cur[], size_t nc, iarray tmp[])
+{
+    size_t i, j, na = 0, nb = 0;
+
+    // Data that remain in the window (in sorted order)
+    for (i = 0; i<nc; i++)
+        if (lb <= cur[i].index && cur[i].index < ub)
+            cur[na++] = cur[i];
+
+    // Data that entered the window, sorted in 'tmp'
+    for (j = lb; j<ub; j++)
+        if ((j < plb || pub <= j) && (vs == NULL || vs[j*K+c] != 0)) {
+            tmp[nb].index = j;
+            tmp[nb++].value = ys[j*K+c];
+        }
+    qsort(tmp, nb, sizeof(iarray), comp);
+
+    // Merge in place, from the back of 'cur'
+    for (i = na, j = nb; j > 0; )
+        if (i > 0 && tmp[j-1].value < cur[i-1].value) {
+            cur[i+j-1] = cur[i-1];
+            i--;
+        }
+        else {
+            cur[i+j-1] = tmp[j-1];
+            j--;
+        }
+    return na+nb;
+}
+
+// Kernel-weighted quantiles of 'y' at each domain point. The weight of each
+// datum is its kernel weight (times its weight in 'vs', if not NULL). The p_th
+// quantile is the smallest value of 'y' at which the cumulative weight (in
+// order of 'y') reaches p times the total weight, or the midpoint of the two
+// values where it is reached exactly (so the weighted median of an even
+// number of equally weighted data is the usual median). The kernel weights
+// of every datum change from one domain point to the next, so only the
+// order of the values is kept as the window slides along the (sorted)
+// domain (see slideWindow()). All Q quantiles are then found in a single
+// O(w) pass through the window. The domain is split into one contiguous
+// chunk per thread, and the columns of 'y' are processed in blocks that
+// bound the memory of the sorted windows. Empty windows return NaN.
+// qhat[k + n*(q + Q*c)] is quantile probs[q] of column c at mus[k].
+void kernelQuantiles(const double xs[], const double ys[], const double vs[], size_t K,
+                     const double mus[], size_t n, double bw, const double bws[], int kernel, double period,
+                     const size_t lbIdx[], const size_t ubIdx[], int precision, vexpFun vexp,
+                     const double probs[], size_t Q, double qhat[])
+{
+    size_t i, maxWin = 1, cb, *qo = malloc(Q * sizeof(size_t));
+
+    // Order of the probabilities
+    for (i = 0; i<Q; i++) {
+        size_t j = i;
+        for (; j > 0 && probs[i] < probs[qo[j-1]]; j--)
+            qo[j] = qo[j-1];
+        qo[j] = i;
+    }
+
+    // Find the widest window, which sizes the per-thread buffers
+    for (i = 0; i<n; i++)
+        if (ubIdx[i] > lbIdx[i] && maxWin < ubIdx[i]-lbIdx[i])
+            maxWin = ubIdx[i]-lbIdx[i];
+    cb = QUANT_BUF / maxWin; // Columns per block
+    cb = cb < 1 ? 1 : (K < cb ? K : cb);
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+              k0 = n*t/T, k1 = n*(t+1)/T, k, // This thread's chunk of the domain
+              c0, c1, c, r, lb, ub, plb, pub, w, np, q; // Column block; Window (and that of the previous point); Number of pending quantiles
+        double *f = malloc(maxWin * sizeof(double)), // Kernel weights of the window
+               W, C, tol, wr, ylo, yl; // Total weight; Cumulative weight; Tolerance of an exact crossing; Weight of a datum; Value below an exact crossing; Last value
+        iarray **cur = malloc(cb * sizeof(iarray*)), *tmp = malloc(maxWin * sizeof(iarray)), *s;
+        size_t *nc = malloc(cb * sizeof(size_t)); // Number of values in each sorted window
+        for (c = 0; c<cb; c++)
+            cur[c] = malloc(maxWin * sizeof(iarray));
+
+        for (c0 = 0; c0<K; c0 = c1)
+        {
+            c1 = c0+cb < K ? c0+cb : K;
+            for (c = 0; c<cb; c++)
+                nc[c] = 0;
+            for (plb = pub = 0, k = k0; k<k1; k++, plb = lb, pub = ub)
+            {
+                lb = lbIdx[k];
+                ub = ubIdx[k] > lb ? ubIdx[k] : lb;
+                w  = ub-lb;
+                kernelEval(kernel, xs+lb, w, mus[k], bws == NULL ? bw : bws[k], period, precision, vexp, f);
+
+                for (c = c0; c<c1; c++)
+                {
+                    nc[c-c0] = slideWindow(ys, vs, K, c, plb, pub, lb, ub, cur[c-c0], nc[c-c0], tmp);
+                    s = cur[c-c0];
+
+                    for (W = 0, r = 0; r<nc[c-c0]; r++)
+                        W += f[s[r].index-lb] * (vs == NULL ? 1 : vs[s[r].index*K+c]);
+                    if (!(W > 0)) {
+                        for (q = 0; q<Q; q++)
+                            qhat[k+n*(q+Q*c)] = NAN;
+                        continue;
+                    }
+
+                    // Cumulative weight in order of 'y'
+                    tol = 1e-12 * W;
+                    for (C = 0, ylo = yl = 0, np = 0, q = 0, r = 0; r<nc[c-c0] && (q<Q || np); r++)
+                    {
+                        wr = f[s[r].index-lb] * (vs == NULL ? 1 : vs[s[r].index*K+c]);
+                        if (!(wr > 0))
+                            continue;
+                        for (; np; np--) // Midpoint of an exact crossing
+                            qhat[k+n*(qo[q-np]+Q*c)] = (ylo + s[r].value) / 2;
+                        C += wr;
+                        yl = s[r].value;
+                        for (; q<Q && probs[qo[q]]*W - tol <= C; q++)
+                            if (C <= probs[qo[q]]*W + tol) // Reached exactly
+                                np++, ylo = s[r].value;
+                            else
+                                qhat[k+n*(qo[q]+Q*c)] = s[r].value;
+                    }
+                    for (; np; np--) // Reached at the largest value
+                        qhat[k+n*(qo[q-np]+Q*c)] = ylo;
+                    for (; q<Q; q++) // (Rounding of the total weight)
+                        qhat[k+n*(qo[q]+Q*c)] = yl;
+                }
+            }
+        }
+
+        for (c = 0; c<cb; c++)
+            free(cur[c]);
+        free(cur);
+        free(tmp);
+        free(nc);
+        free(f);
+    }
+    free(qo);
+}
+
+// Deep copy a C array into a new MATLAB row vector
+mxArray* copyArray(const double x[], size_t n)
+{
+    mxArray* a = mxCreateDoubleMatrix(1, n, mxREAL);
+    double* p = mxGetPr(a);
+    for (size_t i = 0; i<n; i++)
+        p[i] = x[i];
+    return a;
+}
+
+// Add a field to a (1 x 1) MATLAB struct
+void addField(mxArray* s, const char* name, mxArray* value)
+{
+    mxAddField(s, name);
+    mxSetField(s, 0, name, value);
+}
+
+// Start timing the phases of a call
+void startStats(kstats* st)
+{
+    memset(st, 0, sizeof(kstats));
+    st->t0 = omp_get_wtime();
+}
+
+// End the current phase, and add its wall time to phase 'p'
+void endPhase(kstats* st, int p)
+{
+    double t = omp_get_wtime();
+    st->time[p] += t - st->t0;
+    st->t0 = t;
+}
+
+// Count the kernel windows [lbIdx[k], ubIdx[k]) of 'n' domain points
+void countWindows(kstats* st, const size_t lbIdx[], const size_t ubIdx[], size_t n)
+{
+    for (size_t k = 0; k<n; k++) {
+        double w = ubIdx[k] > lbIdx[k] ? (double)(ubIdx[k]-lbIdx[k]) : 0;
+        st->kernels += w;
+        st->winmax = st->winmax < w ? w : st->winmax;
+    }
+    st->windows += (double)n;
+}
+
+// The 'stats' output: the wall time (in seconds) of each phase and their
+// 'total', the number of threads, the number of kernel weights, the mean
+// and largest window size, and the bytes of the working arrays (including
+// the per-thread kernel buffers)
+mxArray* statsStruct(const kstats* st)
+{
+    mxArray *s = mxCreateStructMatrix(1, 1, 0, NULL), *t = mxCreateStructMatrix(1, 1, 0, NULL);
+    double total = 0;
+    for (int p = 0; p<NUM_PHASES; p++) {
+        addField(t, phaseNames[p], mxCreateDoubleScalar(st->time[p]));
+        total += st->time[p];
+    }
+    addField(t, "total", mxCreateDoubleScalar(total));
+    addField(s, "time", t);
+    addField(s, "threads", mxCreateDoubleScalar((double)numThreads));
+    addField(s, "simd", mxCreateString(simdNames[vexpPath()]));
+    addField(s, "kernels", mxCreateDoubleScalar(st->kernels));
+    addField(s, "winmean", mxCreateDoubleScalar(st->windows > 0 ? st->kernels / st->windows : NAN));
+    addField(s, "winmax", mxCreateDoubleScalar(st->windows > 0 ? st->winmax : NAN));
+    addField(s, "bytes", mxCreateDoubleScalar(st->bytes + (double)numThreads * st->winmax * sizeof(double)));
+    return s;
+}
+
+// Case-insensitive comparison of option names
+bool isOption(const char* a, const char* b)
+{
+    for (; *a && *b; a++, b++)
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+            return false;
+    return *a == *b;
+}
+
+// Is 'a' a real array of a supported class (double, single, int16, int32)?
+bool isSupported(const mxArray* a)
+{
+    mxClassID cls = mxGetClassID(a);
+    return !mxIsComplex(a) && (cls == mxDOUBLE_CLASS || cls == mxSINGLE_CLASS ||
+                               cls == mxINT16_CLASS  || cls == mxINT32_CLASS);
+}
+
+// The data of 'a' as doubles. Arrays of class double are not copied;
+// otherwise a converted copy is returned, which the caller must free().
+double* asDouble(const mxArray* a)
+{
+    if (mxIsDouble(a))
+        return mxGetPr(a);
+    size_t n = mxGetNumberOfElements(a);
+    if (!n)
+        return NULL;
+    double* d = malloc(n * sizeof(double));
+    const void* data = mxGetData(a);
+    mxClassID cls = mxGetClassID(a);
+    for (size_t i = 0; i<n; i++)
+        d[i] = getValue(data, cls, i);
+    return d;
+}
+
+// Parse the optional name-value pairs. The first character array at
+// position 'a0' or later marks the start of the name-value pairs. Returns
+// the number of positional arguments.
+int parseOptions(int nrhs, const mxArray* prhs[], int a0, options* opt)
+{
+    int npos = nrhs; // Number of positional arguments
+    for (int a = a0; a<nrhs; a++)
+        if (mxIsChar(prhs[a])) {
+            npos = a;
+            break;
+        }
+    if ((nrhs-npos) % 2)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional arguments must be given as name-value pairs.");
+
+    // Defaults
+    opt->kernel     = KERN_GAUSS;
+    opt->precision  = EXP_FULL;
+    opt->degree     = 0;
+    opt->cv         = false;
+    opt->cvgrid     = NULL;
+    opt->G          = 0;
+    opt->binned     = false;
+    opt->gridSize   = 0;
+    opt->precompute = false;
+    opt->knn        = 0;
+    opt->nboot      = 0;
+    opt->alpha      = .05;
+    opt->seed       = NAN;
+    opt->single     = false;
+    opt->period     = 0;
+    opt->robust     = 0;
+    opt->probs      = NULL;
+    opt->Q          = 0;
+    opt->weights    = NULL;
+    opt->file       = false;
+    opt->dtype      = mxDOUBLE_CLASS;
+    opt->interleaved = true;
+    opt->offset     = 0;
+    opt->verify     = true;
+    opt->tileSize   = DEFAULT_TILE;
+    opt->threads    = 0;
+    opt->schedule   = SCHED_STATIC;
+    bool precision  = false; // Was 'precision' given?
+
+    for (int a = npos; a<nrhs; a += 2)
+    {
+        char* name = mxArrayToString(prhs[a]);
+        const mxArray* value = prhs[a+1];
+        if (name == NULL)
+            mexErrMsgIdAndTxt("kreg:inputError","Optional argument names must be character arrays.");
+
+        if (isOption(name,"precision")) {
+            char* mode = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (mode != NULL && isOption(mode,"full"))
+                opt->precision = EXP_FULL;
+            else if (mode != NULL && isOption(mode,"fast"))
+                opt->precision = EXP_FAST;
+            else if (mode != NULL && isOption(mode,"single"))
+                opt->precision = EXP_SINGLE;
+            else {
+                mxFree(mode);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'precision' must be 'full', 'fast', or 'single'.");
+            }
+            mxFree(mode);
+            precision = true;
+        }
+        else if (isOption(name,"output")) {
+            char* type = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (type != NULL && isOption(type,"double"))
+                opt->single = false;
+            else if (type != NULL && isOption(type,"single"))
+                opt->single = true;
+            else {
+                mxFree(type);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'output' must be either 'double' or 'single'.");
+            }
+            mxFree(type);
+        }
+        else if (isOption(name,"kernel")) {
+            char* kname = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            int kk;
+            for (kk = 0; kname != NULL && kk<NUM_KERNELS; kk++)
+                if (isOption(kname, kernels[kk].name))
+                    break;
+            mxFree(kname);
+            if (kname == NULL || kk == NUM_KERNELS) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'kernel' must be one of 'gauss', 'pgauss', 'ngauss', 'exp', 'bexp', 'tri', 'rect', 'skew', or 'vonmises'.");
+            }
+            opt->kernel = kk;
+        }
+        else if (isOption(name,"degree")) {
+            double deg = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(deg == 0 || deg == 1 || deg == 2)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'degree' must be 0, 1, or 2.");
+            }
+            opt->degree = (int)deg;
+        }
+        else if (isOption(name,"cv")) {
+            opt->cv = true;
+            opt->G = mxGetNumberOfElements(value);
+            opt->cvgrid = opt->G && mxIsDouble(value) && !mxIsComplex(value) ? mxGetPr(value) : NULL;
+            for (size_t g = 0; g<opt->G; g++)
+                if (opt->cvgrid == NULL || !(0 < opt->cvgrid[g]) || isinf(opt->cvgrid[g])) {
+                    mxFree(name);
+                    mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'cv' must be a double array of positive, finite bandwidths.");
+                }
+        }
+        else if (isOption(name,"method")) {
+            char* mode = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (mode != NULL && isOption(mode,"exact"))
+                opt->binned = false;
+            else if (mode != NULL && isOption(mode,"binned"))
+                opt->binned = true;
+            else {
+                mxFree(mode);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'method' must be either 'exact' or 'binned'.");
+            }
+            mxFree(mode);
+        }
+        else if (isOption(name,"gridsize")) {
+            double gs = mxGetScalar(value);
+            if (!mxIsEmpty(value) && (gs < 2 || isinf(gs) || isnan(gs))) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'gridsize' must be a finite scalar >= 2.");
+            }
+            opt->gridSize = mxIsEmpty(value) ? 0 : (size_t)gs;
+        }
+        else if (isOption(name,"knn")) {
+            double kn = mxGetScalar(value);
+            if (!mxIsEmpty(value) && (mxGetNumberOfElements(value) != 1 || !(kn >= 1) || isinf(kn) || kn != floor(kn))) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'knn' must be a positive integer.");
+            }
+            opt->knn = mxIsEmpty(value) ? 0 : (size_t)kn;
+        }
+        else if (isOption(name,"nboot")) {
+            double B = mxGetScalar(value);
+            if (!mxIsEmpty(value) && (mxGetNumberOfElements(value) != 1 || !(B >= 0) || isinf(B) || B != floor(B))) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'nboot' must be a non-negative integer.");
+            }
+            opt->nboot = mxIsEmpty(value) ? 0 : (size_t)B;
+        }
+        else if (isOption(name,"alpha")) {
+            opt->alpha = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(0 < opt->alpha && opt->alpha < 1)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'alpha' must be a scalar in (0,1).");
+            }
+        }
+        else if (isOption(name,"seed")) {
+            opt->seed = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(0 <= opt->seed) || opt->seed != floor(opt->seed) || 9007199254740992.0 < opt->seed) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'seed' must be a non-negative integer (< 2^53).");
+            }
+        }
+        else if (isOption(name,"period")) {
+            opt->period = mxGetScalar(value);
+            if (!mxIsEmpty(value) && (mxGetNumberOfElements(value) != 1 || !(0 < opt->period) || isinf(opt->period))) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'period' must be a positive, finite scalar.");
+            }
+            opt->period = mxIsEmpty(value) ? 0 : opt->period;
+        }
+        else if (isOption(name,"robust")) {
+            double it = mxGetScalar(value);
+            if (!mxIsEmpty(value) && (mxGetNumberOfElements(value) != 1 || !(it >= 0) || isinf(it) || it != floor(it))) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'robust' must be a non-negative integer.");
+            }
+            opt->robust = mxIsEmpty(value) ? 0 : (size_t)it;
+        }
+        else if (isOption(name,"quantiles")) {
+            opt->Q = mxGetNumberOfElements(value);
+            opt->probs = opt->Q && mxIsDouble(value) && !mxIsComplex(value) ? mxGetPr(value) : NULL;
+            for (size_t q = 0; q<opt->Q; q++)
+                if (opt->probs == NULL || !(0 <= opt->probs[q] && opt->probs[q] <= 1)) {
+                    mxFree(name);
+                    mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'quantiles' must be a double array of probabilities in [0,1].");
+                }
+        }
+        else if (isOption(name,"weights")) {
+            opt->weights = mxIsEmpty(value) ? NULL : value;
+            if (opt->weights != NULL && !isSupported(value)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'weights' must be of class double, single, int16, or int32.");
+            }
+        }
+        else if (isOption(name,"dtype")) {
+            char* type = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (type != NULL && isOption(type,"double"))
+                opt->dtype = mxDOUBLE_CLASS;
+            else if (type != NULL && isOption(type,"single"))
+                opt->dtype = mxSINGLE_CLASS;
+            else if (type != NULL && isOption(type,"int16"))
+                opt->dtype = mxINT16_CLASS;
+            else if (type != NULL && isOption(type,"int32"))
+                opt->dtype = mxINT32_CLASS;
+            else {
+                mxFree(type);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'dtype' must be 'double', 'single', 'int16', or 'int32'.");
+            }
+            mxFree(type);
+            opt->file = true;
+        }
+        else if (isOption(name,"layout")) {
+            char* mode = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (mode != NULL && isOption(mode,"interleaved"))
+                opt->interleaved = true;
+            else if (mode != NULL && isOption(mode,"separate"))
+                opt->interleaved = false;
+            else {
+                mxFree(mode);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'layout' must be either 'interleaved' or 'separate'.");
+            }
+            mxFree(mode);
+            opt->file = true;
+        }
+        else if (isOption(name,"offset")) {
+            double off = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(off >= 0) || isinf(off) || off != floor(off)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'offset' must be a non-negative integer.");
+            }
+            opt->offset = (size_t)off;
+            opt->file = true;
+        }
+        else if (isOption(name,"verify")) {
+            opt->verify = mxGetScalar(value) != 0;
+            opt->file = true;
+        }
+        else if (isOption(name,"tilesize")) {
+            double ts = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(ts >= 1) || isinf(ts)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'tilesize' must be a positive integer.");
+            }
+            opt->tileSize = (size_t)ts;
+            opt->file = true;
+        }
+        else if (isOption(name,"precompute")) {
+            opt->precompute = mxGetScalar(value) != 0;
+        }
+        else if (isOption(name,"threads")) {
+            double nt = mxGetScalar(value);
+            if (mxGetNumberOfElements(value) != 1 || !(nt >= 1 && nt <= MAX_THREADS) || nt != floor(nt)) {
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'threads' must be a positive integer (at most %d).",MAX_THREADS);
+            }
+            opt->threads = (int)nt;
+        }
+        else if (isOption(name,"schedule")) {
+            char* mode = mxIsChar(value) ? mxArrayToString(value) : NULL;
+            if (mode != NULL && isOption(mode,"static"))
+                opt->schedule = SCHED_STATIC;
+            else if (mode != NULL && isOption(mode,"dynamic"))
+                opt->schedule = SCHED_DYNAMIC;
+            else if (mode != NULL && isOption(mode,"guided"))
+                opt->schedule = SCHED_GUIDED;
+            else {
+                mxFree(mode);
+                mxFree(name);
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'schedule' must be 'static', 'dynamic', or 'guided'.");
+            }
+            mxFree(mode);
+        }
+        else {
+            mexErrMsgIdAndTxt("kreg:inputError","Unrecognized optional argument '%s'.",name);
+        }
+        mxFree(name);
+    }
+
+    if (opt->kernel == KERN_VONMISES && !(opt->period > 0))
+        mexErrMsgIdAndTxt("kreg:inputError","The 'vonmises' kernel requires the optional argument 'period'.");
+
+    // Single precision outputs only need single precision kernel weights
+    if (opt->single && !precision)
+        opt->precision = EXP_SINGLE;
+    return npos;
+}
+
+// Build the sorted domain of the regression function from argument 'd'
+// (NULL if omitted), given the 'm' sorted data 'xs'. The number of domain
+// points is returned in 'n'. Returns NULL if 'd' contains no valid values.
+// On a circular 'x' (period > 0), the domain is wrapped onto [0,period),
+// and a default domain of n points is spaced period/n apart from 0.
+double* getDomain(const mxArray* d, const double xs[], size_t m, double period, size_t* n)
+{
+    double* mu = d == NULL ? NULL : asDouble(d); // User input of function domain
+    double* mus; // Sorted/valid data specifying function domain
+    size_t i, j, ex, *idx;
+
+    *n = d == NULL ? 0 : mxGetNumberOfElements(d); // Number of domain points
+
+    // Set defaults?
+    if (mu == NULL || *n==1) {
+        if (mu == NULL || (*mu)==0 || isnan(*mu) || isinf(*mu)) // Empty, or catch bad values
+            *n = (size_t)DEFAULT_LS; // Default to min/max linspace with 100 points
+        else // Scalar
+            *n = (size_t)(*mu); // Default to min/max linspace with 'n' points
+        if (period > 0) { // Equally spaced around the period
+            mus = malloc(*n * sizeof(double));
+            for (i = 0; i<*n; i++)
+                mus[i] = period * (double)i / (double)*n;
+        }
+        else
+            mus = linspace(getmin(xs,m),getmax(xs,m),*n);
+
+    } else { // Array: sorting/data hygiene checks required
+
+        // Create sorted copy of 'mu' skipping over any 'nan' or 'inf' values
+        mus = malloc(*n * sizeof(double));
+
+        // Get sorted indices of 'mu'
+        idx = sortIndex(mu, *n);
+
+        // Copy valid cases
+        ex = 0, i = 0;
+        while (i<*n) {
+            j = i+ex;
+            if( isnan(mu[idx[j]]) || isinf(mu[idx[j]]) ) { // bad values found
+                ex++; // Increment exclusions
+                (*n)--; // Decrement number of valid data cases
+            }
+            else // mu_i is valid
+            {
+                mus[i] = mu[idx[j]]; // deep copy
+                i++;
+            }
+        }
+        free(idx);
+
+        // Verify that not all the data has been excluded
+        if(!i) {
+            free(mus);
+            mus = NULL;
+        }
+        else if (period > 0) { // Wrap onto the period (and re-sort)
+            for (i = 0; i<*n; i++)
+                mus[i] = wrap(mus[i], period);
+            qsort(mus, *n, sizeof(double), compDouble);
+        }
+    }
+    if (d != NULL && !mxIsDouble(d))
+        free(mu);
+    return mus;
+}
+
+// Copy of the 'm' rows (of 'bytes' each) of 'a', preceded by its last 'nl'
+// rows and followed by its first 'nr' rows. 'a' is freed.
+void* wrapRows(void* a, size_t m, size_t nl, size_t nr, size_t bytes)
+{
+    char *src = a, *dst = malloc((nl+m+nr) * bytes);
+    memcpy(dst, src + (m-nl)*bytes, nl*bytes);
+    memcpy(dst + nl*bytes, src, m*bytes);
+    memcpy(dst + (nl+m)*bytes, src, nr*bytes);
+    free(a);
+    return dst;
+}
+
+// Wrap the 'm' sorted data of a circular 'x' (on [0,period)) around the ends
+// of the period: the data within 'left' of the end of the period are copied
+// before the first datum (shifted down by one period), and the data within
+// 'right' of its start are copied after the last datum (shifted up by one
+// period). Every kernel window that crosses an end of the period is then a
+// contiguous run of the arrays, so the regression is computed exactly as it
+// is for a linear 'x', at the cost of only the copied data. The arrays are
+// reallocated; 'ys' (row-major, K columns), 'vs' and 'perm' may be NULL.
+// The number of data copied to each end is returned in 'nl' and 'nr'.
+void wrapData(double** xs, double** ys, double** vs, size_t** perm, size_t m, size_t K, double period,
+              double left, double right, size_t* nl, size_t* nr)
+{
+    size_t i;
+    *nl = m - lowerBound(*xs, 0, m, period-left);
+    *nr = lowerBound(*xs, 0, m, nextafter(right, INFINITY));
+
+    *xs = wrapRows(*xs, m, *nl, *nr, sizeof(double));
+    for (i = 0; i<*nl; i++)
+        (*xs)[i] -= period;
+    for (i = 0; i<*nr; i++)
+        (*xs)[*nl+m+i] += period;
+    if (ys != NULL)
+        *ys = wrapRows(*ys, m, *nl, *nr, K * sizeof(double));
+    if (vs != NULL && *vs != NULL)
+        *vs = wrapRows(*vs, m, *nl, *nr, K * sizeof(double));
+    if (perm != NULL)
+        *perm = wrapRows(*perm, m, *nl, *nr, sizeof(size_t));
+}
+
+// Default bandwidth using Silverman's rule
+double silverman(double s, double I, double W)
+{
+    I /= 1.34;
+    return .9 * (s < I ? s : I)  * 1.0/pow(W, 1.0/5);
+}
+
+// Bandwidth rule of each kernel (as in kreg.m), given the standard deviation
+// 's' and interquartile range 'I' of the data, and the sample size 'W'
+double ruleBandwidth(int kernel, double s, double I, double W)
+{
+    if (kernel == KERN_TRI || kernel == KERN_RECT) // Freedman-Diaconis rule
+        return 2 * I * 1.0/pow(W, 1.0/3);
+    return silverman(s,I,W);
+}
+
+// Default bandwidth of each kernel (as in kreg.m). 'ws' holds the
+// observation weights of the data (NULL if unweighted); the sample size is
+// their effective sample size (see effectiveSize()).
+double defaultBandwidth(int kernel, const double xs[], const double ws[], size_t m)
+{
+    return ruleBandwidth(kernel, std(xs,ws,m), iqr(xs,ws,m), effectiveSize(ws,m));
+}
+
+// The bandwidths of a sweep, given as the array 'a'. Invalid bandwidths are
+// replaced by the default bandwidth (see defaultBandwidth()).
+double* getSweep(const mxArray* a, int kernel, const double xs[], const double ws[], size_t m)
+{
+    size_t B = mxGetNumberOfElements(a), b;
+    double *src = asDouble(a), *sweep = malloc(B * sizeof(double)), def = nan("");
+    for (b = 0; b<B; b++) {
+        sweep[b] = src[b];
+        if (sweep[b]<=0 || isnan(sweep[b]) || isinf(sweep[b])) {
+            if (isnan(def))
+                def = defaultBandwidth(kernel, xs, ws, m);
+            sweep[b] = def;
+        }
+    }
+    if (!mxIsDouble(a))
+        free(src);
+    return sweep;
+}
+
+// Bandwidth sweep: B copies of the 'n' domain points, where the b_th copy
+// has the bandwidth sweep[b] (returned in 'bws'). A single regression over
+// these n*B points, with per-point bandwidths, fits every bandwidth at once:
+// the data are sorted and cleaned once, the windows of each bandwidth gallop
+// along the sorted domain, and the (bandwidth x domain) points are shared
+// by the threads.
+double* sweepDomain(const double mus[], size_t n, const double sweep[], size_t B, double** bws)
+{
+    double* mub = malloc(n * B * sizeof(double));
+    *bws = malloc(n * B * sizeof(double));
+    for (size_t b = 0; b<B; b++)
+        for (size_t k = 0; k<n; k++) {
+            mub[b*n+k] = mus[k];
+            (*bws)[b*n+k] = sweep[b];
+        }
+    return mub;
+}
+
+// Dynamically determine the order of outputs:
+//     Case 1:  krege(...)
+//                 OR
+//             yhat = krege(...)
+//     Case 2: [xhat, yhat] = krege(...)
+//     Case 3: [xhat, yhat,ehat] = krege(...)
+//
+// A regression output of the 'n' domain points, for B bandwidths and K
+// columns of 'y': (1 x n) for a single regression, (n x K) when 'y' is a
+// matrix, and (n x B), or (n x B x K), for a bandwidth sweep.
+mxArray* createOutput(size_t n, size_t B, size_t K, mxClassID cls)
+{
+    mwSize dims[3] = { n, B, K };
+    if (B == 1)
+        return mxCreateNumericMatrix(K>1 ? n : 1, K>1 ? K : n, cls, mxREAL);
+    return mxCreateNumericArray(K>1 ? 3 : 2, dims, cls, mxREAL);
+}
+
+// 'yhat' and 'ehat' are (1 x n) when 'y' is a vector, otherwise they are
+// (n x K), with one column per column of 'y' (see createOutput() for a sweep
+// of B bandwidths). 'ehat' is NULL if not returned. Single precision outputs
+// are accumulated in double precision buffers, which are converted by
+// finishOutputs().
+void initOutputs(int nlhs, mxArray* plhs[], const double mus[], size_t n, size_t B, size_t K, bool single,
+                 double** yhat, double** ehat)
+{
+    mxClassID cls = single ? mxSINGLE_CLASS : mxDOUBLE_CLASS;
+    size_t i;
+
+    // Function always returns something
+    if (nlhs > 1)
+        plhs[0] = mxCreateNumericMatrix(1, n, cls, mxREAL); // 'xhat'
+    else
+        plhs[0] = createOutput(n, B, K, cls); // 'yhat'
+
+    // Allocate additional outputs, if necessary
+    for (i = 1; i<nlhs && i<3; i++)
+        plhs[i] = createOutput(n, B, K, cls);
+
+    // Default 1st output to regression
+    n *= B;
+    *yhat = single ? malloc(n * K * sizeof(double)) : mxGetPr(plhs[0]);
+    *ehat = NULL;
+
+    // Domain is being returned
+    if (nlhs > 1) {
+        if (!single)
+            *yhat = mxGetPr(plhs[1]);
+
+        // Fill the sorted array of domain values
+        for (i = 0; i<n/B; i++)
+            if (single)
+                ((float*)mxGetData(plhs[0]))[i] = (float)mus[i];
+            else
+                mxGetPr(plhs[0])[i] = mus[i];
+    }
+
+    // Check whether error is being computed
+    if (nlhs >= 3)
+        *ehat = single ? malloc(n * K * sizeof(double)) : mxGetPr(plhs[2]);
+}
+
+// Convert the double precision buffers of single precision outputs (see
+// initOutputs()) and free them
+void finishOutputs(int nlhs, mxArray* plhs[], size_t n, size_t K, bool single, double yhat[], double ehat[])
+{
+    if (!single)
+        return;
+    float* y = mxGetData(plhs[nlhs > 1]);
+    float* e = ehat == NULL ? NULL : mxGetData(plhs[2]);
+    for (size_t i = 0; i<n*K; i++) {
+        y[i] = (float)yhat[i];
+        if (e != NULL)
+            e[i] = (float)ehat[i];
+    }
+    free(yhat);
+    free(ehat);
+}
+
+/**************************************************************************
+*                                 THREADS                                 *
+**************************************************************************/
+static int threadCount = 0; // Number of threads set by krege('threads',T) (0 --> OpenMP default)
+
+// Set the number of threads and the schedule of the loops over the domain
+// for this call. The number of threads is 'threads', else the setting of
+// krege('threads',T), else the OpenMP default (e.g., OMP_NUM_THREADS).
+// Neither is set in the OpenMP runtime (see numThreads), so both end with
+// the call.
+void useThreads(int threads, int schedule)
+{
+#if _OPENMP < 200805 // omp_set_schedule() requires OpenMP 3.0
+    if (schedule != SCHED_STATIC)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'schedule' requires OpenMP 3.0 or later (otherwise, set OMP_SCHEDULE).");
+#endif
+    numThreads = threads ? threads : threadCount ? threadCount : omp_get_max_threads();
+    loopSchedule = schedule;
+}
+
+// T = krege('threads',T)
+// Set the number of threads of every later call (until 'clear krege'). A
+// value of 0 (or []) restores the OpenMP default. Returns the number of
+// threads in effect.
+void setThreads(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    if (nlhs>1 || nrhs>2)
+        mexErrMsgIdAndTxt("kreg:inputError","The number of threads is set with krege('threads',T), and returned with T = krege('threads').");
+    if (nrhs == 2) {
+        double nt = mxIsEmpty(prhs[1]) ? 0 : mxGetScalar(prhs[1]);
+        if (mxGetNumberOfElements(prhs[1]) > 1 || !(nt >= 0 && nt <= MAX_THREADS) || nt != floor(nt))
+            mexErrMsgIdAndTxt("kreg:inputError","The number of threads must be a non-negative integer (at most %d).",MAX_THREADS);
+        threadCount = (int)nt;
+    }
+    plhs[0] = mxCreateDoubleScalar(threadCount ? threadCount : omp_get_max_threads());
+}
+
+// S = krege('simd',S)
+// Set the dispatch path of the vectorized exp() of every later call (until
+// 'clear krege'): 'scalar', 'avx2', 'avx512', or 'auto' (the widest path
+// supported by the CPU). Returns the name of the path in effect.
+void setSimd(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    if (nlhs>1 || nrhs>2)
+        mexErrMsgIdAndTxt("kreg:inputError","The dispatch path is set with krege('simd',S), and returned with S = krege('simd').");
+    if (nrhs == 2) {
+        char* name = mxIsChar(prhs[1]) ? mxArrayToString(prhs[1]) : NULL;
+        int s = -1;
+        if (name == NULL || !isOption(name,"auto"))
+            for (s = 0; s<NUM_SIMD; s++)
+                if (name != NULL && isOption(name, simdNames[s]))
+                    break;
+        mxFree(name);
+        if (s == NUM_SIMD)
+            mexErrMsgIdAndTxt("kreg:inputError","The dispatch path must be 'auto', 'scalar', 'avx2', or 'avx512'.");
+        if (s >= 0 && !simdSupported(s))
+            mexErrMsgIdAndTxt("kreg:inputError","The dispatch path '%s' is not supported by this CPU (or build).", simdNames[s]);
+        simdPath = s;
+    }
+    plhs[0] = mxCreateString(simdNames[vexpPath()]);
+}
+
+/**************************************************************************
+*                                  PLANS                                  *
+**************************************************************************/
+static kplan*   plans    = NULL; // Linked list of live plans
+static uint64_t nextPlan = 1;    // Handle of the next plan
+
+// Allocate MEX-persistent memory (which survives between calls to krege)
+void* persistentAlloc(size_t bytes)
+{
+    void* p = mxMalloc(bytes ? bytes : 1);
+    mexMakeMemoryPersistent(p);
+    return p;
+}
+
+// Copy an array into MEX-persistent memory (by every thread; see touchedAlloc())
+void* persistentCopy(const void* src, size_t bytes)
+{
+    void* p = persistentAlloc(bytes);
+    parallelCopy(p, src, bytes);
+    return p;
+}
+
+void destroyPlan(kplan* p)
+{
+    mxFree(p->perm);
+    mxFree(p->xs);
+    mxFree(p->mus);
+    mxFree(p->lbIdx);
+    mxFree(p->ubIdx);
+    mxFree(p->off);
+    mxFree(p->wts);
+    mxFree(p->bws);
+    mxFree(p);
+}
+
+// Free every live plan (also registered with mexAtExit() for 'clear krege')
+void freePlans(void)
+{
+    kplan* p;
+    while (plans != NULL) {
+        p = plans;
+        plans = p->next;
+        destroyPlan(p);
+    }
+}
+
+// Find the plan of handle 'h'. Returns NULL if 'h' is not a live plan.
+kplan* findPlan(const mxArray* h)
+{
+    if (!mxIsUint64(h) || mxGetNumberOfElements(h) != 1)
+        return NULL;
+    uint64_t id = *(uint64_t*)mxGetData(h);
+    kplan* p;
+    for (p = plans; p != NULL; p = p->next)
+        if (p->id == id)
+            return p;
+    return NULL;
+}
+
+// h = krege('plan',x,d,bw,...)
+// Sort 'x', remove invalid values, set the domain and bandwidth, and find the
+// kernel windows once, then store them in a new plan.
+void makePlan(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    if (nlhs>1)
+        mexErrMsgIdAndTxt("kreg:inputError","krege('plan',...) returns a single plan handle.");
+    if (nrhs<2)
+        mexErrMsgIdAndTxt("kreg:inputError","Minimum two inputs required: krege('plan',x)");
+
+    options opt;
+    int npos = parseOptions(nrhs, prhs, 2, &opt);
+    useThreads(opt.threads, opt.schedule);
+    if (opt.cv || opt.binned || opt.nboot || opt.robust || opt.Q || opt.weights != NULL || opt.file)
+        mexErrMsgIdAndTxt("kreg:inputError","Plans do not support the optional arguments 'cv', 'nboot', 'robust', 'quantiles', 'weights', 'method','binned', or the options of krege('file',...).");
+    size_t B = npos>3 && mxGetNumberOfElements(prhs[3]) > 1 ? mxGetNumberOfElements(prhs[3]) : 1; // Number of bandwidths
+    if (B>1 && (opt.knn || !isSupported(prhs[3])))
+        mexErrMsgIdAndTxt("kreg:inputError","A bandwidth sweep must be of class double, single, int16, or int32, and cannot be combined with 'knn'.");
+
+    if (!isSupported(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Argument 'x' must be of class double, single, int16, or int32.");
+    if (npos>2 && !isSupported(prhs[2]))
+        mexErrMsgIdAndTxt("kreg:inputError","Argument 'd' must be of class double, single, int16, or int32.");
+    if (mxIsEmpty(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'x'");
+    const void* x = mxGetData(prhs[1]);
+    mxClassID xcls = mxGetClassID(prhs[1]);
+
+    // Sort 'x' (wrapped onto the period), skipping over any 'nan' or 'inf' values.
+    // Unless wrapped, 'x' is sorted on keys of its native class (see sortIndexOf()).
+    size_t M = mxGetNumberOfElements(prhs[1]), m, n, i, j;
+    double* xd = NULL; // Wrapped 'x'
+    if (opt.period > 0) {
+        xd = malloc(M * sizeof(double));
+        for (i = 0; i<M; i++)
+            xd[i] = wrap(getValue(x, xcls, i), opt.period);
+    }
+    size_t* idx  = xd != NULL ? sortIndex(xd, M) : sortIndexOf(x, xcls, M);
+    size_t* perm = malloc(M * sizeof(size_t));
+    double* xs   = malloc(M * sizeof(double));
+    for (m = 0, i = 0; i<M; i++) {
+        j = idx[i];
+        double xj = xd != NULL ? xd[j] : getValue(x, xcls, j);
+        if (!( isnan(xj) || isinf(xj) )) {
+            perm[m] = j;
+            xs[m++] = xj;
+        }
+    }
+    free(idx);
+    free(xd);
+    if (!m) {
+        free(perm);
+        free(xs);
+        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'x'.");
+    }
+    if (opt.knn > m) {
+        free(perm);
+        free(xs);
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'knn' cannot exceed the number of valid data.");
+    }
+
+    // Domain and bandwidth
+    double* mus = getDomain(npos>2 ? prhs[2] : NULL, xs, m, opt.period, &n);
+    if (mus == NULL) {
+        free(perm);
+        free(xs);
+        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'd'.");
+    }
+    double bw = npos>3 ? mxGetScalar(prhs[3]) : nan("");
+    if (bw<=0 || isnan(bw) || isinf(bw))
+        bw = defaultBandwidth(opt.kernel, xs, NULL, m);
+
+    // Bandwidth sweep (see sweepDomain())
+    double *sweep = NULL, *bws = NULL;
+    if (B>1) {
+        sweep = getSweep(prhs[3], opt.kernel, xs, NULL, m);
+        for (bw = sweep[0], i = 1; i<B; i++) // The widest bandwidth
+            bw = bw < sweep[i] ? sweep[i] : bw;
+        double* mub = sweepDomain(mus, n, sweep, B, &bws);
+        free(mus);
+        free(sweep);
+        mus = mub;
+    }
+
+    // Wrap a circular 'x' around the ends of the period (see mexFunction())
+    if (opt.period > 0)
+    {
+        double lo = -opt.period/2, hi = opt.period/2;
+        size_t nl, nr;
+        if (!opt.knn)
+            kernelSupport(opt.kernel, bw, opt.period, &lo, &hi);
+        wrapData(&xs, NULL, NULL, &perm, m, 1, opt.period, lo < 0 ? -lo : 0, hi > 0 ? hi : 0, &nl, &nr);
+        m += nl+nr;
+    }
+
+    // Store the plan in persistent memory
+    kplan* p = persistentAlloc(sizeof(kplan));
+    p->M         = M;
+    p->m         = m;
+    p->n         = n;
+    p->B         = B;
+    p->bw        = bw;
+    p->kernel    = opt.kernel;
+    p->precision = opt.precision;
+    p->degree    = opt.degree;
+    p->single    = opt.single;
+    p->period    = opt.period;
+    p->perm      = persistentCopy(perm, m * sizeof(size_t));
+    p->xs        = persistentCopy(xs, m * sizeof(double));
+    p->mus       = persistentCopy(mus, n * B * sizeof(double));
+    p->lbIdx     = persistentAlloc(n * B * sizeof(size_t));
+    p->ubIdx     = persistentAlloc(n * B * sizeof(size_t));
+    p->off       = NULL;
+    p->wts       = NULL;
+    p->bws       = bws == NULL ? NULL : persistentCopy(bws, n * B * sizeof(double));
+    free(perm);
+    free(xs);
+    free(mus);
+    free(bws);
+    n *= B; // Number of (bandwidth x domain) points
+
+    if (opt.knn) { // Adaptive bandwidth
+        p->bws = persistentAlloc(n * sizeof(double));
+        knnBandwidth(p->xs, m, p->mus, n, opt.knn, bw, p->bws);
+    }
+    findWindows(p->xs, m, p->mus, n, bw, p->bws, opt.kernel, opt.period, p->lbIdx, p->ubIdx);
+
+    // Precompute the kernel weights?
+    if (opt.precompute)
+    {
+        p->off = persistentAlloc((n+1) * sizeof(size_t));
+        for (p->off[0] = 0, i = 0; i<n; i++)
+            p->off[i+1] = p->off[i] + (p->ubIdx[i] > p->lbIdx[i] ? p->ubIdx[i]-p->lbIdx[i] : 0);
+        p->wts = persistentAlloc(p->off[n] * sizeof(double));
+        kernelWeights(p->xs, p->mus, n, bw, p->bws, opt.kernel, opt.period, p->lbIdx, p->off, opt.precision, getVexp(), p->wts);
+    }
+
+    // Register the plan
+    if (plans == NULL)
+        mexAtExit(freePlans);
+    p->id   = nextPlan++;
+    p->next = plans;
+    plans   = p;
+
+    plhs[0] = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+    *(uint64_t*)mxGetData(plhs[0]) = p->id;
+}
+
+// krege('free',h) or krege('free')
+void freePlan(int nrhs, const mxArray* prhs[])
+{
+    if (nrhs<2) { // Free every plan
+        freePlans();
+        return;
+    }
+    kplan* p = findPlan(prhs[1]), **q;
+    if (p == NULL)
+        mexErrMsgIdAndTxt("kreg:inputError","Invalid plan handle (it may have already been freed).");
+    for (q = &plans; *q != p; q = &(*q)->next);
+    *q = p->next; // Unlink
+    destroyPlan(p);
+}
+
+// [xhat,yhat,ehat,info] = krege(h,y)
+// Gather 'y' through the plan's sort permutation and compute the weighted
+// sums. Invalid values of 'y' are masked out of their own column.
+void applyPlan(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    kstats st;
+    startStats(&st);
+    kplan* p = findPlan(prhs[0]);
+    if (p == NULL)
+        mexErrMsgIdAndTxt("kreg:inputError","Invalid plan handle (it may have already been freed).");
+    if (nrhs != 2)
+        mexErrMsgIdAndTxt("kreg:inputError","Plans are applied with exactly two inputs: krege(h,y)");
+    useThreads(0, SCHED_STATIC);
+    if (!isSupported(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Argument 'y' must be of class double, single, int16, or int32.");
+    const void* y = mxGetData(prhs[1]);
+    mxClassID ycls = mxGetClassID(prhs[1]);
+    if (y == NULL)
+        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'y'");
+
+    size_t M = p->M, m = p->m, K, i, j, c, r;
+    if(mxGetNumberOfElements(prhs[1]) == M) // 'y' is a vector
+        K = 1;
+    else if(mxGetM(prhs[1]) == M) // 'y' is a matrix with one column per signal
+        K = mxGetN(prhs[1]);
+    else // Check for parity
+        mexErrMsgIdAndTxt("kreg:inputError","Dimension mismatch between the plan's 'x' and 'y'");
+
+    // Gather 'y' in sorted, row-major order
+    double* ys = touchedAlloc(m * K); // Sorted 'y' (row-major)
+    double* vs = NULL; // Sorted validity mask of 'y' (row-major); only allocated if required
+    for (i = 0; i<m; i++)
+    {
+        j = p->perm[i];
+        for (c = 0; c<K; c++)
+        {
+            double v = getValue(y, ycls, j+c*M);
+            bool ok = !( isnan(v) || isinf(v) );
+            if (!ok && vs == NULL) {
+                vs = touchedAlloc(m * K);
+                for (r = 0; r<i*K+c; r++)
+                    vs[r] = 1; // All previous values were valid
+            }
+            ys[i*K+c] = ok ? v : 0; // Deep copy (zero-out masked values)
+            if (vs != NULL)
+                vs[i*K+c] = ok;
+        }
+    }
+    st.bytes += (double)m * K * sizeof(double) * (1 + (vs != NULL));
+    endPhase(&st, PH_CLEAN);
+
+    double *yhat, *ehat;
+    initOutputs(nlhs, plhs, p->mus, p->n, p->B, K, p->single, &yhat, &ehat);
+    if (p->single)
+        st.bytes += (double)p->n * p->B * K * sizeof(double) * (1 + (ehat != NULL));
+    countWindows(&st, p->lbIdx, p->ubIdx, p->n * p->B);
+    endPhase(&st, PH_OUTPUT);
+    kernelRegression(p->xs, ys, vs, NULL, K, p->mus, p->n * p->B, p->bw, p->bws, p->kernel, p->period, p->degree, p->lbIdx, p->ubIdx, p->wts, p->off,
+                     p->precision, getVexp(), false, yhat, ehat);
+    endPhase(&st, PH_KERNEL);
+    finishOutputs(nlhs, plhs, p->n * p->B, K, p->single, yhat, ehat);
+
+    if (nlhs>3)
+    {
+        plhs[3] = mxCreateStructMatrix(1, 1, 0, NULL);
+        if (p->B > 1) { // Bandwidths of the sweep
+            mxArray* bw = mxCreateDoubleMatrix(1, p->B, mxREAL);
+            for (i = 0; i<p->B; i++)
+                mxGetPr(bw)[i] = p->bws[i*p->n];
+            addField(plhs[3], "bw", bw);
+        }
+        else
+            addField(plhs[3], "bw", p->bws == NULL ? mxCreateDoubleScalar(p->bw) : copyArray(p->bws, p->n));
+    }
+    endPhase(&st, PH_OUTPUT);
+    if (nlhs>4)
+        plhs[4] = statsStruct(&st);
+
+    free(ys);
+    free(vs);
+}
+
+/**************************************************************************
+*                     STREAMING (MEMORY-MAPPED FILES)                     *
+**************************************************************************/
+// A read-only mapping of a raw binary file of m (x,y) records, sorted by 'x'
+typedef struct kfile
+{
+    const char* base;   // Mapping of the whole file
+    size_t    size;     // Size of the file (bytes)
+    mxClassID cls;      // Class of every value
+    size_t    m;        // Number of records
+    size_t    esz;      // Bytes per value
+    size_t    xoff, yoff, stride; // Byte offset of x_0 and y_0; Bytes between records
+    bool      separate; // Are 'x' and 'y' separate columns (or interleaved)?
+#ifdef _WIN32
+    HANDLE    fh, mh;   // File and mapping handles
+#else
+    int       fd;       // File descriptor
+#endif
+} kfile;
+
+// Map the file at 'path'. Returns false if it cannot be opened or mapped.
+bool mapFile(const char* path, kfile* f)
+{
+    f->base = NULL;
+    f->size = 0;
+#ifdef _WIN32
+    LARGE_INTEGER sz;
+    f->mh = NULL;
+    f->fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f->fh == INVALID_HANDLE_VALUE)
+        return false;
+    if (GetFileSizeEx(f->fh, &sz) && sz.QuadPart > 0)
+        f->mh = CreateFileMappingA(f->fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (f->mh != NULL)
+        f->base = MapViewOfFile(f->mh, FILE_MAP_READ, 0, 0, 0);
+    if (f->base == NULL) {
+        if (f->mh != NULL)
+            CloseHandle(f->mh);
+        CloseHandle(f->fh);
+        return false;
+    }
+    f->size = (size_t)sz.QuadPart;
+#else
+    struct stat st;
+    void* map = MAP_FAILED;
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0)
+        return false;
+    if (!fstat(f->fd, &st) && st.st_size > 0)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (map == MAP_FAILED) {
+        close(f->fd);
+        return false;
+    }
+    f->base = map;
+    f->size = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void unmapFile(kfile* f)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(f->base);
+    CloseHandle(f->mh);
+    CloseHandle(f->fh);
+#else
+    munmap((void*)f->base, f->size);
+    close(f->fd);
+#endif
+    f->base = NULL;
+}
+
+// Release the pages of bytes [from,to) of the mapping from the resident
+// memory of the process (they are read from the file again if touched)
+void releasePages(const kfile* f, size_t from, size_t to)
+{
+    to = to < f->size ? to : f->size;
+    if (to <= from)
+        return;
+#ifdef _WIN32
+    VirtualUnlock((void*)(f->base+from), to-from); // (Removes unlocked pages from the working set)
+#else
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    from -= from % page;
+    madvise((void*)(f->base+from), to-from, MADV_DONTNEED);
+#endif
+}
+
+// Release the pages of records [lo,hi)
+void releaseRecords(const kfile* f, size_t lo, size_t hi)
+{
+    releasePages(f, f->xoff + lo*f->stride, f->xoff + hi*f->stride);
+    if (f->separate)
+        releasePages(f, f->yoff + lo*f->stride, f->yoff + hi*f->stride);
+}
+
+// The 'x' or 'y' value of record i
+double fileX(const kfile* f, size_t i)
+{
+    return getValue(f->base + f->xoff + i*f->stride, f->cls, 0);
+}
+double fileY(const kfile* f, size_t i)
+{
+    return getValue(f->base + f->yoff + i*f->stride, f->cls, 0);
+}
+
+// The 'x' of record i, read from the file rather than the mapping, so that
+// the scattered reads of a search do not grow the resident memory (each
+// page fault of a mapping also maps the neighbouring pages)
+double readX(const kfile* f, size_t i)
+{
+    char buf[8];
+    size_t off = f->xoff + i*f->stride;
+#ifdef _WIN32
+    OVERLAPPED ov;
+    DWORD got;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)off;
+    ov.OffsetHigh = (DWORD)((uint64_t)off >> 32);
+    if (!ReadFile(f->fh, buf, (DWORD)f->esz, &got, &ov) || got != (DWORD)f->esz)
+        return NAN;
+#else
+    if (pread(f->fd, buf, f->esz, (off_t)off) != (ssize_t)f->esz)
+        return NAN;
+#endif
+    return getValue(buf, f->cls, 0);
+}
+
+// Index of the first record in [lo,hi) with an 'x' of at least 'v' (see
+// lowerBound())
+size_t fileLowerBound(const kfile* f, size_t lo, size_t hi, double v)
+{
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (readX(f, mid) < v)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Search forward from record 'start' (see gallop())
+size_t fileGallop(const kfile* f, size_t start, double v)
+{
+    size_t lo = start, step = 1, hi;
+    if (lo >= f->m || !(readX(f, lo) < v))
+        return lo;
+    for (hi = lo+1; hi < f->m && readX(f, hi) < v; step *= 2) {
+        lo = hi;
+        hi = f->m-lo > step ? lo+step : f->m;
+    }
+    return fileLowerBound(f, lo+1, hi, v);
+}
+
+// One pass through the 'x' of the file, one tile of 'tile' records at a
+// time (each tile is scanned in parallel, then released). Returns false if
+// 'x' is not sorted or not finite (if 'verify'). The sums of (x-x_0) and
+// (x-x_0)^2 are returned in 's1' and 's2' (if 'moments').
+bool scanFile(const kfile* f, size_t tile, bool verify, bool moments, double* s1, double* s2)
+{
+    double x0 = fileX(f, 0), a = 0, b = 0;
+    bool ok = true;
+    size_t lo, hi;
+    long long int i; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+
+    for (lo = 0; lo<f->m && ok; lo = hi)
+    {
+        hi = f->m-lo > tile ? lo+tile : f->m;
+        int bad = 0;
+        #pragma omp parallel for schedule(static) reduction(+:a,b,bad) num_threads(numThreads)
+        for (i = (long long int)lo; i<(long long int)hi; i++)
+        {
+            double x = fileX(f, (size_t)i), d = x-x0;
+            if (verify && (isnan(x) || isinf(x) || (i > 0 && x < fileX(f, (size_t)i-1))))
+                bad++;
+            if (moments)
+                a += d, b += d*d;
+        }
+        ok = !bad;
+        releaseRecords(f, lo > 0 ? lo-1 : 0, hi);
+    }
+    *s1 = a;
+    *s2 = b;
+    return ok;
+}
+
+// Kernel regression of a file that is too large to load: krege('file',...)
+// (see the header). The windows of the domain are found by binary search
+// of the 'x' of the file. The domain is then split into tiles, each of which
+// spans at most opt->tileSize records (or the window of one domain point,
+// if larger). The records of each tile are copied (and converted) into
+// buffers, regressed in parallel, and their pages released, so that the
+// resident memory is bounded by the tile size rather than the file size.
+void fileRegression(int nlhs, mxArray* plhs[], int nrhs, const mxArray* prhs[])
+{
+    kstats st;
+    startStats(&st);
+    if (nlhs>5)
+        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 5 outputs.");
+    if (nrhs<2 || !mxIsChar(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","The file is given as a character array: krege('file',path,d,bw)");
+    options opt;
+    int npos = parseOptions(nrhs, prhs, 2, &opt);
+    useThreads(opt.threads, opt.schedule);
+    if (opt.cv || opt.binned || opt.nboot || opt.robust || opt.Q || opt.weights != NULL || opt.knn || opt.period > 0 || opt.precompute ||
+        (npos>3 && mxGetNumberOfElements(prhs[3]) > 1))
+        mexErrMsgIdAndTxt("kreg:inputError","Files only support the optional arguments 'kernel', 'degree', 'precision', 'output', 'threads', 'schedule', 'dtype', 'layout', 'offset', 'verify', and 'tilesize'.");
+    if (npos>2 && !isSupported(prhs[2]))
+        mexErrMsgIdAndTxt("kreg:inputError","Argument 'd' must be of class double, single, int16, or int32.");
+
+    // Map the file and check that it holds whole records
+    char* path = mxArrayToString(prhs[1]);
+    kfile f;
+    bool mapped = path != NULL && mapFile(path, &f);
+    mxFree(path);
+    if (!mapped)
+        mexErrMsgIdAndTxt("kreg:inputError","Unable to open and map the file.");
+    size_t esz = opt.dtype == mxDOUBLE_CLASS ? 8 : (opt.dtype == mxINT16_CLASS ? 2 : 4), // Bytes per value
+           m = f.size > opt.offset ? (f.size-opt.offset) / (2*esz) : 0; // Number of records
+    if (!m || opt.offset + 2*esz*m != f.size) {
+        unmapFile(&f);
+        mexErrMsgIdAndTxt("kreg:inputError","The size of the file (less 'offset') is not a whole number of (x,y) records of class 'dtype'.");
+    }
+    f.cls = opt.dtype;
+    f.esz = esz;
+    f.m = m;
+    f.separate = !opt.interleaved;
+    f.xoff = opt.offset;
+    f.yoff = opt.offset + (opt.interleaved ? esz : m*esz);
+    f.stride = opt.interleaved ? 2*esz : esz;
+
+    // Verify that 'x' is sorted, and compute its moments for a default bandwidth
+    double bw = npos<4 ? nan("") : mxGetScalar(prhs[3]), s1 = 0, s2 = 0;
+    bool def = bw<=0 || isnan(bw) || isinf(bw);
+    if ((opt.verify || def) && !scanFile(&f, opt.tileSize, opt.verify, def, &s1, &s2)) {
+        unmapFile(&f);
+        mexErrMsgIdAndTxt("kreg:inputError","The 'x' of the file is not sorted, or contains nan or inf values.");
+    }
+    endPhase(&st, PH_CLEAN);
+    if (def) { // Interquartile range from the order statistics (see iqr())
+        double q[2], t[2] = { .25, .75 }, r, l;
+        for (int k = 0; k<2; k++) {
+            r = t[k]*(double)m - .5;
+            r = r > (double)(m-1) ? (double)(m-1) : (r < 0 ? 0 : r);
+            l = floor(r);
+            q[k] = readX(&f, (size_t)l);
+            if (r > l)
+                q[k] += (r-l) * (readX(&f, (size_t)l+1) - q[k]);
+        }
+        bw = ruleBandwidth(opt.kernel, m>1 ? sqrt( (s2 - s1*s1/(double)m) / (double)(m-1) ) : NAN, q[1]-q[0], (double)m);
+    }
+    endPhase(&st, PH_BANDWIDTH);
+
+    // Domain (the default spans the first and last 'x')
+    double ends[2] = { readX(&f, 0), readX(&f, m-1) };
+    size_t n;
+    double* mus = getDomain(npos<3 ? NULL : prhs[2], ends, 2, 0, &n);
+    if (mus == NULL) {
+        unmapFile(&f);
+        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'd'.");
+    }
+    endPhase(&st, PH_DOMAIN);
+
+    // Windows of every domain point (as findWindows(), but read from the file)
+    size_t *lbIdx = malloc(n * sizeof(size_t)), *ubIdx = malloc(n * sizeof(size_t));
+    double lo, hi;
+    bool closed = kernelSupport(opt.kernel, bw, 0, &lo, &hi);
+    if (closed)
+        hi = nextafter(hi, INFINITY);
+    long long int k; // OpenMP compiled under MSVC is only supported for the C89 standard :D
+    #pragma omp parallel num_threads(numThreads)
+    {
+        size_t T = (size_t)omp_get_num_threads(), t = (size_t)omp_get_thread_num(),
+              k0 = n*t/T, k1 = n*(t+1)/T, j; // This thread's chunk of the domain
+        for (j = k0; j<k1; j++) {
+            lbIdx[j] = j == k0 ? fileLowerBound(&f, 0, m, mus[j]+lo) : fileGallop(&f, lbIdx[j-1], mus[j]+lo);
+            ubIdx[j] = j == k0 ? fileLowerBound(&f, lbIdx[j], m, mus[j]+hi)
+                               : fileGallop(&f, ubIdx[j-1] > lbIdx[j] ? ubIdx[j-1] : lbIdx[j], mus[j]+hi);
+        }
+    }
+    countWindows(&st, lbIdx, ubIdx, n);
+    endPhase(&st, PH_WINDOWS);
+
+    double *yhat, *ehat;
+    initOutputs(nlhs, plhs, mus, n, 1, 1, opt.single, &yhat, &ehat);
+    endPhase(&st, PH_OUTPUT);
+
+    // Regress one tile at a time
+    size_t k0, k1, a, b, i, cap = 0, tiles = 0, // Tile of the domain; Its records [a,b); Buffer capacity; Number of tiles
+          *lbt = malloc(n * sizeof(size_t)), *ubt = malloc(n * sizeof(size_t)); // Windows within the tile
+    double *xs = NULL, *ys = NULL, *vs = NULL;
+    for (k0 = 0; k0<n; k0 = k1, tiles++)
+    {
+        a = lbIdx[k0], b = ubIdx[k0] > a ? ubIdx[k0] : a;
+        for (k1 = k0+1; k1<n; k1++) { // Extend the tile while it fits
+            size_t b1 = ubIdx[k1] > b ? ubIdx[k1] : b;
+            if (b1-a > opt.tileSize) // (The windows of a sorted domain only move forward)
+                break;
+            b = b1;
+        }
+        if (cap < b-a) {
+            free(xs);
+            free(ys);
+            free(vs);
+            cap = b-a;
+            xs = malloc(cap * sizeof(double));
+            ys = malloc(cap * sizeof(double));
+            vs = malloc(cap * sizeof(double));
+        }
+
+        // Copy the records of the tile (invalid 'y' values are masked)
+        int nbad = 0;
+        #pragma omp parallel for schedule(static) reduction(+:nbad) num_threads(numThreads)
+        for (k = 0; k<(long long int)(b-a); k++) {
+            double v = fileY(&f, a+(size_t)k);
+            bool ok = !( isnan(v) || isinf(v) );
+            xs[k] = fileX(&f, a+(size_t)k);
+            ys[k] = ok ? v : 0;
+            vs[k] = ok;
+            nbad += !ok;
+        }
+        endPhase(&st, PH_CLEAN);
+        for (i = k0; i<k1; i++) {
+            lbt[i] = lbIdx[i]-a;
+            ubt[i] = (ubIdx[i] > lbIdx[i] ? ubIdx[i] : lbIdx[i])-a;
+        }
+        kernelRegression(xs, ys, nbad ? vs : NULL, NULL, 1, mus+k0, k1-k0, bw, NULL, opt.kernel, 0, opt.degree,
+                         lbt+k0, ubt+k0, NULL, NULL, opt.precision, getVexp(), false, yhat+k0, ehat == NULL ? NULL : ehat+k0);
+        releaseRecords(&f, a, b);
+        endPhase(&st, PH_KERNEL);
+    }
+    finishOutputs(nlhs, plhs, n, 1, opt.single, yhat, ehat);
+
+    if (nlhs>3)
+    {
+        plhs[3] = mxCreateStructMatrix(1, 1, 0, NULL);
+        addField(plhs[3], "bw", mxCreateDoubleScalar(bw));
+        addField(plhs[3], "records", mxCreateDoubleScalar((double)m));
+        addField(plhs[3], "tiles", mxCreateDoubleScalar((double)tiles));
+    }
+    st.bytes += (double)n * (sizeof(double) + 4*sizeof(size_t)) + 3.0 * cap * sizeof(double) +
+                (double)opt.single * n * sizeof(double) * (1 + (ehat != NULL));
+    endPhase(&st, PH_OUTPUT);
+    if (nlhs>4)
+        plhs[4] = statsStruct(&st);
+
+    unmapFile(&f);
     free(lbIdx);
     free(ubIdx);
+    free(lbt);
+    free(ubt);
     free(xs);
     free(ys);
+    free(vs);
     free(mus);
+}
 
-} // mexFunction
+/**************************************************************************
+*                                   MEX                                   *
+**************************************************************************/
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    //////////////////////////////////////////////////////////////////////
+    //                          BASIC DATA HYGENE
+    ///////////////////////////////////////////////////////////////////////
+
+    // Plan API: krege('plan',x,d,bw), krege(h,y), krege('free',h)
+    // Streaming API: krege('file',path,d,bw)
+    // Threads: krege('threads',T); dispatch path: krege('simd',S)
+    if (nrhs>0 && mxIsChar(prhs[0]))
+    {
+        char* cmd = mxArrayToString(prhs[0]);
+        bool plan = isOption(cmd,"plan"), release = isOption(cmd,"free"), file = isOption(cmd,"file"),
+             threads = isOption(cmd,"threads"), simd = isOption(cmd,"simd");
+        mxFree(cmd);
+        if (threads)
+            setThreads(nlhs, plhs, nrhs, prhs);
+        else if (simd)
+            setSimd(nlhs, plhs, nrhs, prhs);
+        else if (plan)
+            makePlan(nlhs, plhs, nrhs, prhs);
+        else if (release)
+            freePlan(nrhs, prhs);
+        else if (file)
+            fileRegression(nlhs, plhs, nrhs, prhs);
+        else
+            mexErrMsgIdAndTxt("kreg:inputError","Unrecognized command; expected krege('plan',...), krege('free',h), krege('file',...), krege('threads',T), or krege('simd',S).");
+        return;
+    }
+    if (nrhs>0 && mxIsUint64(prhs[0]))
+    {
+        if (nlhs>5)
+            mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 5 outputs.");
+        applyPlan(nlhs, plhs, nrhs, prhs);
+        return;
+    }
+    kstats st; // Timing of the phases of this call (see the 'stats' output)
+    startStats(&st);
+
+    // Check number of outputs
+    if (nlhs>5)
+        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 5 outputs.");
+    // Get 'x' and 'y' inputs
+    if (nrhs<2)
+        mexErrMsgIdAndTxt("kreg:inputError","Minimum two inputs required: krege(x,y)");
+    // else:
+    // Data of class single, int16 or int32 are converted to double as they
+    // are copied, so 'x' and 'y' are not converted by MATLAB beforehand
+    if (!isSupported(prhs[0]) || !isSupported(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Arguments 'x' and 'y' must be of class double, single, int16, or int32.");
+    const void* x = mxGetData(prhs[0]); // arg 0 --> x data
+    const void* y = mxGetData(prhs[1]); // arg 1 --> y data
+    mxClassID xcls = mxGetClassID(prhs[0]), ycls = mxGetClassID(prhs[1]);
+
+    // Ensure data arrays are filled
+    if (x == NULL)
+        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'x'");
+    if (y == NULL)
+        mexErrMsgIdAndTxt("kreg:inputError","Empty matrix passed to argument 'y'");
+
+    ///////////////////////////////////////////////////////////////////////
+    //                  PARSE OPTIONAL NAME-VALUE PAIRS
+    //
+    //      Positional arguments (x, y, d, bw) are followed by any number
+    //      of name-value pairs. The first character array at position 3
+    //      or later marks the start of the name-value pairs.
+    ///////////////////////////////////////////////////////////////////////
+
+    options opt;
+    int npos = parseOptions(nrhs, prhs, 2, &opt); // Number of positional arguments
+    useThreads(opt.threads, opt.schedule);
+    if (opt.precompute)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'precompute' is only supported by plans: krege('plan',...)");
+    if (opt.file)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional arguments 'dtype', 'layout', 'offset', 'verify' and 'tilesize' are only supported by krege('file',...)");
+    if (opt.binned && (opt.degree || opt.kernel != KERN_GAUSS))
+        mexErrMsgIdAndTxt("kreg:inputError","The binned approximation only supports 'degree' 0 and the 'gauss' kernel.");
+    if (opt.knn && (opt.cv || opt.binned))
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'knn' cannot be combined with 'cv' or 'method','binned'.");
+    if (opt.nboot && (opt.binned || nlhs<4))
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'nboot' requires the exact method and the 'info' output (which holds the bands).");
+    if (npos>2 && !isSupported(prhs[2]))
+        mexErrMsgIdAndTxt("kreg:inputError","Argument 'd' must be of class double, single, int16, or int32.");
+    if (opt.period > 0 && (opt.cv || opt.binned))
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'period' cannot be combined with 'cv' or 'method','binned'.");
+    size_t B = npos>3 && mxGetNumberOfElements(prhs[3]) > 1 ? mxGetNumberOfElements(prhs[3]) : 1; // Number of bandwidths
+    if (B>1 && (opt.cv || opt.knn || opt.binned || !isSupported(prhs[3])))
+        mexErrMsgIdAndTxt("kreg:inputError","A bandwidth sweep must be of class double, single, int16, or int32, and cannot be combined with 'cv', 'knn', or 'method','binned'.");
+    if (opt.robust && (B>1 || opt.cv || opt.binned))
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'robust' cannot be combined with 'cv', 'method','binned', or a bandwidth sweep.");
+    if (opt.Q && (opt.binned || nlhs<4))
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'quantiles' requires the exact method and the 'info' output (which holds the quantiles).");
+    int precision = opt.precision;
+    bool cv = opt.cv, binned = opt.binned;
+    double* cvgrid = opt.cvgrid;
+    size_t G = opt.G, gridSize = opt.gridSize;
+
+    ///////////////////////////////////////////////////////////////////////
+    //          SORT 'X' AND 'Y' AND REMOVE NANS/INFS
+    ///////////////////////////////////////////////////////////////////////
+
+    // Get size variable for data
+    size_t m = mxGetNumberOfElements(prhs[0]), // Number of (x,y) data
+           M = m, // Number of (x,y) data, including invalid cases
+           K;     // Number of columns of 'y'
+    if(mxGetNumberOfElements(prhs[1]) == m) // 'y' is a vector
+        K = 1;
+    else if(mxGetM(prhs[1]) == m) // 'y' is a matrix with one column per signal
+        K = mxGetN(prhs[1]);
+    else // Check for parity
+        mexErrMsgIdAndTxt("kreg:inputError","Dimension mismatch between arguments 'x' and 'y'");
+
+    size_t i;
+
+    // Observation weights (rows with a weight of 0 or NaN are excluded)
+    const void* wt = opt.weights == NULL ? NULL : mxGetData(opt.weights);
+    mxClassID wcls = opt.weights == NULL ? mxDOUBLE_CLASS : mxGetClassID(opt.weights);
+    if (wt != NULL) {
+        if (mxGetNumberOfElements(opt.weights) != m)
+            mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'weights' must have one element per element of 'x'.");
+        for (i = 0; i<m; i++)
+            if (getValue(wt, wcls, i) < 0 || isinf(getValue(wt, wcls, i)))
+                mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'weights' must be non-negative and finite.");
+    }
+
+    endPhase(&st, PH_CLEAN);
+
+    // Get sorted indices of 'x'. The binned approximation does not require
+    // sorted data (unless cross-validating), so the data is left in order.
+    size_t* idx;
+    double* xd = NULL; // Wrapped 'x' (only allocated if required)
+    if (binned && !cv) {
+        idx = malloc(m * sizeof(size_t));
+        for (i = 0; i<m; i++)
+            idx[i] = i;
+    }
+    else if (!(opt.period > 0)) // Sorted on keys of its native class
+        idx = sortIndexOf(x, xcls, m);
+    else { // Wrapped onto the period before sorting
+        xd = malloc(m * sizeof(double));
+        for (i = 0; i<m; i++)
+            xd[i] = wrap(getValue(x, xcls, i), opt.period);
+        idx = sortIndex(xd, m);
+    }
+
+    // Create sorted copies of 'x' and 'y', skipping over any 'nan' or 'inf' values.
+    // 'y' is copied in row-major order (i.e., the K values of datum j are
+    // contiguous), so that each kernel weight is applied across all columns
+    // of 'y' in a single pass through memory
+    endPhase(&st, PH_SORT);
+    double* xs = touchedAlloc(m);     // Sorted 'x'
+    double* ys = touchedAlloc(m * K); // Sorted 'y' (row-major)
+    double* vs = NULL; // Sorted validity mask (times the weights) of 'y' (row-major); only allocated if required
+    double* ws = NULL; // Sorted observation weights
+    size_t j, c, ex = 0, nv; // Iterators i/j/c (used throughout); Number of excluded indices; Number of valid columns
+    if (wt != NULL) {
+        ws = malloc(m * sizeof(double));
+        vs = touchedAlloc(M * K);
+    }
+    i = 0;
+    while (i<m) {
+        j = idx[i+ex];
+
+        // Count valid columns of 'y' in this row
+        for (nv = 0, c = 0; c<K; c++)
+            nv += !( isnan(getValue(y,ycls,j+c*M)) || isinf(getValue(y,ycls,j+c*M)) );
+
+        double xj = xd != NULL ? xd[j] : getValue(x, xcls, j),
+               wj = wt != NULL ? getValue(wt, wcls, j) : 1;
+        if( isnan(xj) || isinf(xj) || !nv || !(wj > 0) ) // bad values found
+        {
+            ex++; // Increment exclusions
+            m--;  // Decrement number of valid data cases. Now we do not need to
+                  // realloc(), since all subsequent steps through 'xs' or 'ys'
+                  // use for(;i<m;i++) and since 'xs' and 'yx' only contain valid
+                  // cases for indices { 0, ..., m }
+        }
+        else // x_i is valid and at least one y_i is valid
+        {
+            // Some (but not all) columns are invalid: these are masked out
+            // per column, rather than discarding the whole row
+            if (nv<K && vs == NULL) {
+                vs = touchedAlloc(M * K);
+                for (size_t r = 0; r<i*K; r++)
+                    vs[r] = 1; // All previous rows were fully valid
+            }
+
+            xs[i] = xj; // Deep copy
+            if (ws != NULL)
+                ws[i] = wj;
+            for (c = 0; c<K; c++) {
+                double v = getValue(y, ycls, j+c*M);
+                bool ok = !( isnan(v) || isinf(v) );
+                ys[i*K+c] = ok ? v : 0; // Deep copy (zero-out masked values)
+                if (vs != NULL)
+                    vs[i*K+c] = ok ? wj : 0;
+            }
+            i++;
+        }
+    }
+    st.bytes += (double)M * (sizeof(size_t) + (xd != NULL) * sizeof(double) + sizeof(double) +
+                             K * sizeof(double) * (1 + (vs != NULL)) + (ws != NULL) * sizeof(double));
+    free(idx);
+    free(xd);
+    endPhase(&st, PH_CLEAN);
+
+    // Verify that not all the data has been excluded
+    if(!i) {
+        free(xs);
+        free(ys);
+        free(vs);
+        free(ws);
+        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'x' and/or 'y'.");
+    };
+
+    ///////////////////////////////////////////////////////////////////////
+    //      SORT 'MU' (i.e., the function domain) AND REMOVE NANS/INFS
+    ///////////////////////////////////////////////////////////////////////
+    
+    size_t n; // Number of domain points
+    double* mus = getDomain(npos<3 ? NULL : prhs[2], xs, m, opt.period, &n); // Sorted/valid function domain
+
+    // Verify that not all the data has been excluded
+    if (mus == NULL) {
+        free(xs);
+        free(ys);
+        free(vs);
+        free(ws);
+        mexErrMsgIdAndTxt("kreg:inputError","Insufficient valid data in 'd'.");
+    }
+    st.bytes += (double)n * sizeof(double);
+    endPhase(&st, PH_DOMAIN);
+
+    ///////////////////////////////////////////////////////////////////////
+    //                      SET DEFAULT BANDWIDTH?
+    ///////////////////////////////////////////////////////////////////////
+
+    double bw;
+    if (npos<4)
+        bw = nan("");
+    else
+        bw = mxGetScalar(prhs[3]); // arg 3 --> bandwidth
+
+    // Ensure validity of bw; set a default for invalid cases using Silverman's rule
+    if (bw<=0 || isnan(bw) || isinf(bw) || (cv && !G)) // Will catch bw<=0, bw==[], bw==NaN, bw==Inf
+        bw = defaultBandwidth(opt.kernel, xs, ws, m);
+
+    // Select the bandwidth by leave-one-out cross-validation?
+    double* cverr = NULL;
+    bool ownGrid = false; // Was the grid allocated here?
+    if (cv)
+    {
+        // By default, search log-spaced multiples of Silverman's rule
+        if (!G) {
+            ownGrid = true;
+            G = DEFAULT_CV;
+            cvgrid = malloc(G * sizeof(double));
+            for (i = 0; i<G; i++)
+                cvgrid[i] = bw * pow(10, -1 + 1.5*(double)i/(G-1)); // [.1, ~3.16] x Silverman
+        }
+
+        cverr = malloc(G * sizeof(double));
+        st.bytes += (double)G * sizeof(double) * (1 + ownGrid);
+        cvError(xs, ys, vs, m, K, cvgrid, G, opt.kernel, opt.degree, precision, getVexp(), cverr);
 
+        // Use the bandwidth that minimizes the prediction error
+        for (j = 0, i = 1; i<G; i++)
+            if (cverr[i] < cverr[j])
+                j = i;
+        if (isinf(cverr[j])) {
+            if (ownGrid)
+                free(cvgrid);
+            free(cverr);
+            free(xs);
+            free(ys);
+            free(vs);
+            free(ws);
+            free(mus);
+            mexErrMsgIdAndTxt("kreg:inputError","Insufficient data to cross-validate the bandwidth.");
+        }
+        bw = cvgrid[j];
+    }
+
+    if (opt.knn > m) {
+        free(xs);
+        free(ys);
+        free(vs);
+        free(ws);
+        free(mus);
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'knn' cannot exceed the number of valid data.");
+    }
+
+    // The binned grid is sized in bandwidths (e.g., the default bandwidth of
+    // data without spread is 0)
+    if (binned && !(bw > 0)) {
+        if (ownGrid)
+            free(cvgrid);
+        free(cverr);
+        free(xs);
+        free(ys);
+        free(vs);
+        free(ws);
+        free(mus);
+        mexErrMsgIdAndTxt("kreg:inputError","The binned approximation requires a positive bandwidth (e.g., the data have no spread).");
+    }
+
+    // Bandwidth sweep: every bandwidth is fit at once (see sweepDomain())
+    double *sweep = NULL, // Bandwidths of the sweep
+           *bws = NULL;   // Bandwidth of each domain point
+    if (B>1)
+    {
+        sweep = getSweep(prhs[3], opt.kernel, xs, ws, m);
+        for (bw = sweep[0], i = 1; i<B; i++) // The widest bandwidth
+            bw = bw < sweep[i] ? sweep[i] : bw;
+        double* mub = sweepDomain(mus, n, sweep, B, &bws);
+        free(mus);
+        mus = mub;
+        st.bytes += (double)(B + 2*n*B) * sizeof(double);
+    }
+    size_t N = n*B; // Number of (bandwidth x domain) points
+    endPhase(&st, PH_BANDWIDTH);
+
+    // Wrap the data of a circular 'x' around the ends of the period, as far
+    // as the kernel reaches (or half a period, for the nearest neighbours)
+    size_t nl = 0, nr = 0; // Number of data copied to the start/end
+    if (opt.period > 0)
+    {
+        double lo = -opt.period/2, hi = opt.period/2;
+        if (!opt.knn)
+            kernelSupport(opt.kernel, bw, opt.period, &lo, &hi);
+        wrapData(&xs, &ys, &vs, NULL, m, K, opt.period, lo < 0 ? -lo : 0, hi > 0 ? hi : 0, &nl, &nr);
+        m += nl+nr;
+        st.bytes += (double)m * sizeof(double) * (1 + K * (1 + (vs != NULL)));
+        endPhase(&st, PH_CLEAN);
+    }
+
+    // Adaptive bandwidth: twice the distance to the knn_th nearest neighbour
+    if (opt.knn)
+    {
+        bws = malloc(n * sizeof(double));
+        st.bytes += (double)n * sizeof(double);
+        knnBandwidth(xs, m, mus, n, opt.knn, bw, bws);
+        endPhase(&st, PH_BANDWIDTH);
+    }
+    
+    // Robust (LOWESS) reweighting of the data
+    if (opt.robust)
+    {
+        double* rw = robustWeights(xs, ys, vs, m, nl, nr, K, bw, opt.knn, opt.kernel, opt.period, opt.degree,
+                                   precision, getVexp(), opt.robust);
+        free(vs);
+        vs = rw;
+        st.bytes += (double)m * K * sizeof(double);
+        endPhase(&st, PH_EXTRA);
+    }
+
+    ///////////////////////////////////////////////////////////////////////
+    //                          INITIALIZE OUTPUTS
+    ///////////////////////////////////////////////////////////////////////
+
+    double *yhat, *ehat; // Pointers to the regression and its error (NULL if not returned)
+    initOutputs(nlhs, plhs, mus, n, B, K, opt.single, &yhat, &ehat);
+    if (opt.single)
+        st.bytes += (double)N * K * sizeof(double) * (1 + (ehat != NULL));
+    endPhase(&st, PH_OUTPUT);
+
+    ///////////////////////////////////////////////////////////////////////
+    //                          REGRESSION ROUTINE
+    ///////////////////////////////////////////////////////////////////////
+
+    double eps = 0, *ebound = NULL; // Error bound of the binned approximation
+    double *blo = NULL, *bhi = NULL; // Bootstrap bands
+    double *qhat = NULL; // Kernel-weighted quantiles
+    uint64_t seed = 0; // Seed of the bootstrap resamples
+
+    if (binned) // Approximate
+    {
+        // By default, the grid spacing is at most 1/BIN_RES of a bandwidth
+        if (!gridSize) {
+            double lo = getmin(xs,m), hi = getmax(xs,m); // (as spanned by binnedRegression(); 'xs' may be unsorted)
+            double range = (hi < mus[n-1] ? mus[n-1] : hi) - (mus[0] < lo ? mus[0] : lo);
+            double gs = ceil(range/bw*BIN_RES)+1; // (clamped before the cast)
+            gridSize = gs < DEFAULT_GRID ? DEFAULT_GRID : (MAX_GRID < gs ? MAX_GRID : (size_t)gs);
+        }
+        if (nlhs>3)
+            ebound = malloc(n * K * sizeof(double));
+        eps = binnedRegression(xs, ys, vs, m, K, mus, n, bw, gridSize, getVexp(), yhat, ehat, ebound);
+        st.bytes += (double)(nlhs>3) * n * K * sizeof(double);
+        endPhase(&st, PH_KERNEL);
+    }
+    else // Exact
+    {
+        size_t* lbIdx = malloc(N * sizeof(size_t)); // Indices of 'xs' and 'ys' that correspond to mu +/- NUM_BW * bw
+        size_t* ubIdx = malloc(N * sizeof(size_t));
+        findWindows(xs, m, mus, N, bw, bws, opt.kernel, opt.period, lbIdx, ubIdx);
+        st.bytes += 2.0 * N * sizeof(size_t);
+        countWindows(&st, lbIdx, ubIdx, N);
+        endPhase(&st, PH_WINDOWS);
+        kernelRegression(xs, ys, vs, NULL, K, mus, N, bw, bws, opt.kernel, opt.period, opt.degree, lbIdx, ubIdx, NULL, NULL, precision, getVexp(), false, yhat, ehat);
+        endPhase(&st, PH_KERNEL);
+
+        // Bootstrap confidence bands?
+        if (opt.nboot)
+        {
+            static uint64_t calls = 0; // Distinguishes random seeds drawn within the same second
+            seed = isnan(opt.seed) ? mix64((uint64_t)time(NULL) ^ mix64(++calls)) >> 11 : (uint64_t)opt.seed;
+            blo = malloc(N * K * sizeof(double));
+            bhi = malloc(N * K * sizeof(double));
+            bootstrap(xs, ys, vs, m, nl, nr, K, mus, N, bw, bws, opt.kernel, opt.period, opt.degree, lbIdx, ubIdx, precision, getVexp(),
+                      opt.nboot, opt.alpha, seed, blo, bhi);
+            st.bytes += 2.0 * N * K * sizeof(double);
+        }
+
+        // Kernel-weighted quantiles?
+        if (opt.Q)
+        {
+            qhat = malloc(N * opt.Q * K * sizeof(double));
+            kernelQuantiles(xs, ys, vs, K, mus, N, bw, bws, opt.kernel, opt.period, lbIdx, ubIdx, precision, getVexp(),
+                            opt.probs, opt.Q, qhat);
+            st.bytes += (double)N * opt.Q * K * sizeof(double);
+        }
+        free(lbIdx);
+        free(ubIdx);
+        endPhase(&st, PH_EXTRA);
+    }
+    finishOutputs(nlhs, plhs, N, K, opt.single, yhat, ehat);
+
+    ///////////////////////////////////////////////////////////////////////
+    //                      RETURN DETAILS OF THE FIT
+    ///////////////////////////////////////////////////////////////////////
+    if (nlhs>3)
+    {
+        plhs[3] = mxCreateStructMatrix(1, 1, 0, NULL);
+        addField(plhs[3], "bw", sweep != NULL ? copyArray(sweep, B) : bws == NULL ? mxCreateDoubleScalar(bw) : copyArray(bws, n));
+        if (cv) {
+            addField(plhs[3], "cvgrid", copyArray(cvgrid, G));
+            addField(plhs[3], "cverr", copyArray(cverr, G));
+        }
+        if (binned) {
+            mxArray* eb = mxCreateDoubleMatrix(K>1 ? n : 1, K>1 ? K : n, mxREAL);
+            memcpy(mxGetPr(eb), ebound, n * K * sizeof(double));
+            addField(plhs[3], "gridsize", mxCreateDoubleScalar((double)gridSize));
+            addField(plhs[3], "eps", mxCreateDoubleScalar(eps));
+            addField(plhs[3], "errbound", eb);
+        }
+        if (opt.nboot) {
+            mxArray *l = createOutput(n, B, K, mxDOUBLE_CLASS),
+                    *h = createOutput(n, B, K, mxDOUBLE_CLASS);
+            memcpy(mxGetPr(l), blo, N * K * sizeof(double));
+            memcpy(mxGetPr(h), bhi, N * K * sizeof(double));
+            addField(plhs[3], "lo", l);
+            addField(plhs[3], "hi", h);
+            addField(plhs[3], "nboot", mxCreateDoubleScalar((double)opt.nboot));
+            addField(plhs[3], "seed", mxCreateDoubleScalar((double)seed));
+        }
+        if (opt.Q) {
+            mwSize dims[4] = { n, 0, 0, 0 }, nd = 1; // (n x [B] x Q x [K])
+            if (B>1)
+                dims[nd++] = B;
+            dims[nd++] = opt.Q;
+            if (K>1)
+                dims[nd++] = K;
+            mxArray* qa = mxCreateNumericArray(nd, dims, mxDOUBLE_CLASS, mxREAL);
+            memcpy(mxGetPr(qa), qhat, N * opt.Q * K * sizeof(double));
+            addField(plhs[3], "quantiles", qa);
+            addField(plhs[3], "probs", copyArray(opt.probs, opt.Q));
+        }
+    }
+    endPhase(&st, PH_OUTPUT);
+    if (nlhs>4)
+        plhs[4] = statsStruct(&st);
+
+    // Free any allocated arrays before exiting
+    if (ownGrid)
+        free(cvgrid);
+    free(cverr);
+    free(ebound);
+    free(blo);
+    free(bhi);
+    free(qhat);
+    free(sweep);
+    free(bws);
+    free(xs);
+    free(ys);
+    free(vs);
+    free(ws);
+    free(mus);
+
+} // mexFunction
@@ -0,0 +1,85 @@
+function results = krege_test
+% Test the vectorized exp() of krege.c against a scalar exp() reference.
+% Fits a Gaussian kernel regression with krege() at 'precision' 'full' and
+% 'fast' on every dispatch path supported by this machine ('scalar',
+% 'avx2', 'avx512'; see krege('simd',S)), and compares each fit with the
+% same regression computed with MATLAB's exp(). Throws an error if any fit
+% deviates from the reference by more than its bound.
+%
+% USAGE
+%   krege_test;
+%   results = krege_test;
+%
+% OUTPUT
+%   results - Struct array with one element per (path, precision), with
+%             fields
+%               simd      - The dispatch path.
+%               precision - The 'precision' of krege().
+%               supported - Whether this machine supports the path. The
+%                           remaining fields are NaN for unsupported paths.
+%               maxrel    - The largest relative deviation of 'yhat' from
+%                           the reference.
+%               bound     - The bound on 'maxrel'.
+%
+% NOTES
+%   The relative error of each kernel weight is at most 3.1e-16 ('full')
+%   or 6.9e-9 ('fast'). With positive 'y', a relative error e in every
+%   kernel weight moves the fit by a relative error of at most 2*e/(1-e).
+%   The bound adds the rounding error of summing the largest window (in
+%   both krege() and the reference).
+%
+% Devin H. Kehoe, dhkehoe@gmail.com
+
+paths = {'scalar','avx2','avx512'};
+precisions = {'full','fast'};
+experr = [3.1e-16, 6.9e-9]; % Relative error of each kernel weight
+
+% Data, domain and bandwidth (with positive 'y', so the bound is relative)
+s  = RandStream('mt19937ar','Seed',1);
+x  = 100*rand(s,2000,1);
+y  = 1+rand(s,2000,1);
+d  = linspace(0,100,500)';
+bw = .5;
+
+% Reference: scalar exp() over the windows of krege() ([d-3*bw, d+3*bw))
+yref = zeros(size(d));
+for k = 1:numel(d)
+    i = d(k)+bw*-3 <= x & x < d(k)+bw*3;
+    f = exp( -(x(i)-d(k)).^2 / (2*bw*bw) );
+    yref(k) = sum(f.*y(i)) / sum(f);
+end
+
+% Restore the dispatch path on exit (even on failure)
+old = krege('simd');
+cleanup = onCleanup(@() krege('simd',old));
+
+results = struct('simd',{},'precision',{},'supported',{},'maxrel',{},'bound',{});
+failed = false;
+for p = 1:numel(paths)
+    try
+        krege('simd',paths{p});
+        supported = true;
+    catch
+        supported = false;
+    end
+    for q = 1:numel(precisions)
+        r = struct('simd',paths{p},'precision',precisions{q},'supported',supported,'maxrel',nan,'bound',nan);
+        if supported
+            [~,yhat,~,~,stats] = krege(x,y,d,bw,'precision',precisions{q});
+            if ~strcmp(stats.simd,paths{p})
+                error('krege_test:simd','krege() used the ''%s'' path instead of ''%s''.',stats.simd,paths{p});
+            end
+            r.maxrel = max(abs(yhat(:)-yref)./yref);
+            r.bound  = 2*experr(q)/(1-experr(q)) + 4*stats.winmax*eps;
+            failed = failed | ~(r.maxrel <= r.bound);
+            fprintf('%-6s  %-4s  max relative error %.3g (bound %.3g)\n',paths{p},precisions{q},r.maxrel,r.bound);
+        else
+            fprintf('%-6s  %-4s  not supported on this machine\n',paths{p},precisions{q});
+        end
+        results(end+1) = r; %#ok<AGROW>
+    end
+end
+
+if failed
+    error('krege_test:bound','krege() deviates from the scalar exp() reference by more than the bound.');
+end
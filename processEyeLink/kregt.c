@@ -8,6 +8,10 @@
 *
 * USAGE (MATLAB):
 *   yhat = kregt(x,y,bw);
+*   yhat = kregt(x,y,bw,'output','single');
+*   yhat = kregt(x,y,bw,'threads',4,'schedule','dynamic');
+*   [yhat,stats] = kregt(x,y,bw);
+*   T = kregt('threads',T);
 *
 * INPUT:
 *    double x[]: The x-coordinate values of the data to be regressed.
@@ -18,15 +22,52 @@
 *        NOTES: (1) 'x' and 'y' must contain the same number of elements.
 *               (2) 'x' and 'y' are not checked for invalid cases (NaN, Inf),
 *                   which, if present, will distort results.
+*               (3) 'x' and 'y' may also be of class single, int16 or int32
+*                   (e.g., raw samples). They are read directly, without a
+*                   conversion by MATLAB, and accumulated in double.
+*
+* OPTIONAL NAME-VALUE PAIRS:
+*    'output': 'double' (default) or 'single'. The class of 'yhat'. It is
+*              always computed in double precision.
+*   'threads': Number of threads of this call. By default, the number set
+*              by kregt('threads',T), else the OpenMP default (e.g.,
+*              OMP_NUM_THREADS).
+*  'schedule': 'static' (default), 'dynamic', or 'guided'. The OpenMP
+*              schedule of the samples among the threads ('dynamic' and
+*              'guided' hand out chunks of 1024 samples).
+*
+* THREADS:
+*   kregt('threads',T) sets the number of threads of every later call until
+*   'clear kregt'. kregt('threads',0) restores the OpenMP default, and
+*   T = kregt('threads') returns the number in effect. When several MATLAB
+*   workers share a machine, give each its own share of the cores, and pin
+*   the threads of each worker to its cores with OMP_PLACES and
+*   OMP_PROC_BIND (see krege.c).
 *
 * OUTPUT:
 *   double yhat[]: The fitted regression function. Equal length to 'x'.
+*   struct  stats: Instrumentation of the call (e.g., for capacity planning
+*                  or production logs), with fields
+*                   time    - Wall time (s) of each phase: 'setup'
+*                             (arguments and allocation), 'kernel' (kernel
+*                             weights, windows and sums), 'output', and
+*                             their 'total'.
+*                   threads - The number of threads.
+*                   kernels - The number of kernel weights (i.e., the sum
+*                             of the window sizes).
+*                   winmean - The mean number of samples per window.
+*                   winmax  - The largest number of samples in a window.
+*                   bytes   - The bytes of the working arrays (not
+*                             including the output).
 *
 * EXCEPTIONS:
-*   1) Greater than 1 value was returned.
-*   2) Less than or greater than 3 arguments were passed.
+*   1) Greater than 2 values were returned.
+*   2) Less than 3 arguments were passed.
 *   3) Empty array passed as an argument for 'x' or 'y'.
 *   4) Mismatched number of elements in 'x' and 'y'.
+*   5) 'x' or 'y' is not of class double, single, int16 or int32.
+*   6) Unrecognized or invalid optional name-value pair (or number of
+*      threads).
 *
 *
 *
@@ -41,6 +82,7 @@
 *
 * DEPENDENCIES:
 *   OpenMP v2.0 or later (https://www.openmp.org/resources/openmp-compilers-tools/)
+*   The 'dynamic' and 'guided' schedules require OpenMP v3.0 or later.
 *
 * AUTHOR:
 *   Devin H. Kehoe
@@ -55,6 +97,9 @@
 *   dhk     nov 29, 2025    -adopted OpenMP for parallelization (x5 speed-up)
 *   dhk     dec  1, 2025    -assuming ordered time series data, extra computational
 *                            acceleration is possible (additional x2 speed-up)
+*   dhk     oct 16, 2026    -single/int16/int32 inputs; single output
+*                           -thread count ('threads') and loop schedule ('schedule')
+*                           -per-phase timing and counters ('stats' output)
 *
 *
 **************************************************************************/
@@ -62,10 +107,156 @@
 #include <omp.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
 #include "mex.h"
 
 #define NUM_BW      3   // Smoothing range in units of bandwidth
 #define int64       long long int // OpenMP compiled under MSVC is only supported for the C89 standard :D
+#define MAX_THREADS 4096 // Maximum number of threads of the 'threads' option
+#define SCHED_CHUNK 1024 // Chunk size of the 'dynamic' and 'guided' schedules (samples)
+
+// Schedules of the parallel loop over the samples (see useThreads())
+enum { SCHED_STATIC, SCHED_DYNAMIC, SCHED_GUIDED };
+
+// Phases of a call, timed for the 'stats' output
+enum { PH_SETUP, PH_KERNEL, PH_OUTPUT, NUM_PHASES };
+static const char* phaseNames[NUM_PHASES] = { "setup", "kernel", "output" };
+
+static int threadCount = 0; // Number of threads set by kregt('threads',T) (0 --> OpenMP default)
+
+// Number of threads and schedule of the regression loop of this call (see
+// useThreads()). They are passed to the parallel region, rather than set in
+// the OpenMP runtime, whose settings are shared with other MEX files (and
+// later calls) on the MATLAB thread.
+static int numThreads = 1, loopSchedule = SCHED_STATIC;
+
+/**************************************************************************
+*                                FUNCTIONS                                *
+**************************************************************************/
+// Case-insensitive comparison of option names
+bool isOption(const char* a, const char* b)
+{
+    for (; *a && *b; a++, b++)
+        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+            return false;
+    return *a == *b;
+}
+
+// Is 'a' a real array of a supported class (double, single, int16, int32)?
+bool isSupported(const mxArray* a)
+{
+    mxClassID cls = mxGetClassID(a);
+    return !mxIsComplex(a) && (cls == mxDOUBLE_CLASS || cls == mxSINGLE_CLASS ||
+                               cls == mxINT16_CLASS  || cls == mxINT32_CLASS);
+}
+
+// Element 'i' of the data of a supported class, as a double
+double getValue(const void* data, mxClassID cls, int64 i)
+{
+    switch (cls) {
+        case mxSINGLE_CLASS: return ((const float*)data)[i];
+        case mxINT16_CLASS:  return ((const int16_t*)data)[i];
+        case mxINT32_CLASS:  return ((const int32_t*)data)[i];
+        default:             return ((const double*)data)[i];
+    }
+}
+
+// Sum of f[j-off] * y[j] over j = lb, ..., ub-1, with one loop per class of
+// 'y' so that each is compiled (and vectorized) for its own type
+double weightedSum(const void* y, mxClassID cls, const double f[], int64 lb, int64 ub, int64 off)
+{
+    double s = 0;
+    int64 j;
+    switch (cls) {
+        case mxSINGLE_CLASS:
+            for (j = lb; j<ub; j++)
+                s += f[j-off] * ((const float*)y)[j];
+            break;
+        case mxINT16_CLASS:
+            for (j = lb; j<ub; j++)
+                s += f[j-off] * ((const int16_t*)y)[j];
+            break;
+        case mxINT32_CLASS:
+            for (j = lb; j<ub; j++)
+                s += f[j-off] * ((const int32_t*)y)[j];
+            break;
+        default:
+            for (j = lb; j<ub; j++)
+                s += f[j-off] * ((const double*)y)[j];
+    }
+    return s;
+}
+
+// Number of threads given by 'a' (0 for [] if 'empty'), or -1 if invalid
+int getThreads(const mxArray* a, bool empty)
+{
+    double nt = empty && mxIsEmpty(a) ? 0 : mxGetScalar(a);
+    if (mxGetNumberOfElements(a) > 1 || !(nt >= (empty ? 0 : 1) && nt <= MAX_THREADS) || nt != floor(nt))
+        return -1;
+    return (int)nt;
+}
+
+// Set the number of threads and the schedule of this call. The number of
+// threads is 'threads', else the setting of kregt('threads',T), else the
+// OpenMP default (e.g., OMP_NUM_THREADS). Neither is set in the OpenMP
+// runtime (see numThreads), so both end with the call.
+void useThreads(int threads, int schedule)
+{
+#if _OPENMP < 200805 // omp_set_schedule() requires OpenMP 3.0
+    if (schedule != SCHED_STATIC)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional argument 'schedule' requires OpenMP 3.0 or later (otherwise, set OMP_SCHEDULE).");
+#endif
+    numThreads = threads ? threads : threadCount ? threadCount : omp_get_max_threads();
+    loopSchedule = schedule;
+}
+
+// Apply the schedule of this call to the schedule(runtime) loop of the
+// enclosing parallel region. It is set in the implicit task of each thread
+// of the region, so it ends with the region.
+void runSchedule(void)
+{
+#if _OPENMP >= 200805 // omp_set_schedule() requires OpenMP 3.0
+    omp_set_schedule(loopSchedule == SCHED_DYNAMIC ? omp_sched_dynamic : loopSchedule == SCHED_GUIDED ? omp_sched_guided : omp_sched_static,
+                     loopSchedule == SCHED_STATIC ? 0 : SCHED_CHUNK);
+#endif
+}
+
+// End the current phase (which started at 't0'), and add its wall time to
+// phase 'p'
+void endPhase(double time[], int p, double* t0)
+{
+    double t = omp_get_wtime();
+    time[p] += t - *t0;
+    *t0 = t;
+}
+
+// Add the field 'name' to the (scalar) struct 's'
+void addField(mxArray* s, const char* name, mxArray* value)
+{
+    mxAddField(s, name);
+    mxSetField(s, 0, name, value);
+}
+
+// The 'stats' output: the wall time of each phase (and their total), and the
+// counters of the call (see the header)
+mxArray* statsStruct(const double time[], double kernels, double windows, double winmax, double bytes)
+{
+    mxArray *s = mxCreateStructMatrix(1, 1, 0, NULL), *t = mxCreateStructMatrix(1, 1, 0, NULL);
+    double total = 0;
+    for (int p = 0; p<NUM_PHASES; p++) {
+        addField(t, phaseNames[p], mxCreateDoubleScalar(time[p]));
+        total += time[p];
+    }
+    addField(t, "total", mxCreateDoubleScalar(total));
+    addField(s, "time", t);
+    addField(s, "threads", mxCreateDoubleScalar((double)numThreads));
+    addField(s, "kernels", mxCreateDoubleScalar(kernels));
+    addField(s, "winmean", mxCreateDoubleScalar(windows > 0 ? kernels / windows : NAN));
+    addField(s, "winmax", mxCreateDoubleScalar(windows > 0 ? winmax : NAN));
+    addField(s, "bytes", mxCreateDoubleScalar(bytes));
+    return s;
+}
 
 /**************************************************************************
 *                                   MEX                                   *
@@ -76,15 +267,38 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     //                          BASIC DATA HYGENE
     ///////////////////////////////////////////////////////////////////////
 
+    // T = kregt('threads',T): set the number of threads of every later call
+    if (nrhs>0 && mxIsChar(prhs[0]))
+    {
+        char* cmd = mxArrayToString(prhs[0]);
+        bool threads = cmd != NULL && isOption(cmd,"threads");
+        mxFree(cmd);
+        if (!threads || nlhs>1 || nrhs>2)
+            mexErrMsgIdAndTxt("kreg:inputError","The number of threads is set with kregt('threads',T), and returned with T = kregt('threads').");
+        if (nrhs == 2) {
+            int nt = getThreads(prhs[1], true);
+            if (nt < 0)
+                mexErrMsgIdAndTxt("kreg:inputError","The number of threads must be a non-negative integer (at most %d).",MAX_THREADS);
+            threadCount = nt;
+        }
+        plhs[0] = mxCreateDoubleScalar(threadCount ? threadCount : omp_get_max_threads());
+        return;
+    }
+
+    double t0 = omp_get_wtime(), time[NUM_PHASES] = { 0 }; // Start of the current phase; Wall time of each phase
+
     // Check number of outputs
-    if (nlhs>1)
-        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 3 outputs.");
+    if (nlhs>2)
+        mexErrMsgIdAndTxt("kreg:inputError","Cannot return more than 2 outputs.");
     // Get 'x' and 'y' inputs
-    if (nrhs != 3)
-        mexErrMsgIdAndTxt("kreg:inputError","Exactly three inputs required: kregt(x,y,bw)");
+    if (nrhs < 3)
+        mexErrMsgIdAndTxt("kreg:inputError","Three inputs required: kregt(x,y,bw)");
     // else:
-    double* x  = mxGetPr(prhs[0]); // arg 0 --> x data
-    double* y  = mxGetPr(prhs[1]); // arg 1 --> y data
+    if (!isSupported(prhs[0]) || !isSupported(prhs[1]))
+        mexErrMsgIdAndTxt("kreg:inputError","Arguments 'x' and 'y' must be of class double, single, int16, or int32.");
+    const void* x = mxGetData(prhs[0]); // arg 0 --> x data
+    const void* y = mxGetData(prhs[1]); // arg 1 --> y data
+    mxClassID ycls = mxGetClassID(prhs[1]);
 
     // Ensure data arrays are filled
     if (x == NULL)
@@ -97,13 +311,49 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     if(mxGetNumberOfElements(prhs[1]) != N) // Check for parity
         mexErrMsgIdAndTxt("kreg:inputError","Dimension mismatch between arguments 'x' and 'y'");
 
+    // Optional name-value pairs
+    if ((nrhs-3) % 2)
+        mexErrMsgIdAndTxt("kreg:inputError","Optional arguments must be given as name-value pairs.");
+    bool single = false; // Return a single precision output?
+    int threads = 0, schedule = SCHED_STATIC; // Number of threads (0 --> default); Schedule (SCHED_*)
+    for (int a = 3; a<nrhs; a += 2)
+    {
+        char* name = mxArrayToString(prhs[a]);
+        char* type = mxIsChar(prhs[a+1]) ? mxArrayToString(prhs[a+1]) : NULL;
+        bool ok = name != NULL;
+        if (ok && isOption(name,"output")) {
+            single = type != NULL && isOption(type,"single");
+            ok = single || (type != NULL && isOption(type,"double"));
+        }
+        else if (ok && isOption(name,"threads"))
+            ok = (threads = getThreads(prhs[a+1], false)) > 0;
+        else if (ok && isOption(name,"schedule")) {
+            ok = type != NULL;
+            if (ok && isOption(type,"dynamic"))
+                schedule = SCHED_DYNAMIC;
+            else if (ok && isOption(type,"guided"))
+                schedule = SCHED_GUIDED;
+            else
+                ok = ok && isOption(type,"static");
+        }
+        else
+            ok = false;
+        mxFree(type);
+        mxFree(name);
+        if (!ok)
+            mexErrMsgIdAndTxt("kreg:inputError","Invalid optional argument %d.",a+1);
+    }
+
+    // Set the number of threads and the schedule of the regression loop
+    useThreads(threads, schedule);
+
 
     ///////////////////////////////////////////////////////////////////////
     //                      SET DEFAULT BANDWIDTH?
     ///////////////////////////////////////////////////////////////////////
 
     double bw = mxGetScalar(prhs[2]), // Bandwidth in units of seconds
-           dt = x[1]-x[0]; // Sampling interval
+           dt = getValue(x,mxGetClassID(prhs[0]),1) - getValue(x,mxGetClassID(prhs[0]),0); // Sampling interval
 
     // Ensure validity of bw
     if (bw<=0 || isnan(bw) || isinf(bw)) // Will catch bw<=0, bw==[], bw==NaN, bw==Inf
@@ -115,9 +365,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     ///////////////////////////////////////////////////////////////////////
     //                          INITIALIZE OUTPUTS
-    // Function always returns something
-    plhs[0] = mxCreateDoubleMatrix(1, N, mxREAL);
-    double *yhat = mxGetPr(plhs[0]);
+    // Function always returns something (a single output is computed in a double buffer)
+    plhs[0] = mxCreateNumericMatrix(1, N, single ? mxSINGLE_CLASS : mxDOUBLE_CLASS, mxREAL);
+    double *yhat = single ? malloc(N * sizeof(double)) : mxGetPr(plhs[0]);
 
     ///////////////////////////////////////////////////////////////////////
     //                          REGRESSION ROUTINE
@@ -145,13 +395,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     // Open parallel section
     int64 i,j; // Iterators    
-
-    // Utilize the maximum number of threads available
-    omp_set_num_threads(omp_get_max_threads());
+    endPhase(time, PH_SETUP, &t0);
 
     // Assign variable ownership:
-    #pragma omp parallel reduction(+:yh) shared(yhat,ubIdx,lbIdx) private(i,j,diff)
+    #pragma omp parallel reduction(+:yh) shared(yhat,ubIdx,lbIdx) private(i,j,diff) num_threads(numThreads)
     {
+        runSchedule();
+
         // Compute kernel values
         #pragma omp for schedule(static) nowait
         for (i = 0; i<M; i++) {
@@ -193,12 +443,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         #pragma omp barrier
 
         // Compute regression
-        #pragma omp for schedule(static)
+        #pragma omp for schedule(runtime)
         for (i = 0; i<N; i++) // Step through domain
         {
-            // Reset summation variables
-            for (yh = 0, j = lbIdx[i]; j<ubIdx[i]; j++) // Step through data
-                yh += f[ j-i+nbin ] * y[j]; // For the i-th kernel, weight the j-th 'y' data
+            // For the i-th kernel, weight the j-th 'y' data
+            yh = weightedSum(y, ycls, f, lbIdx[i], ubIdx[i], i-nbin);
 
             // Avoid race condition on array update
             #pragma omp critical
@@ -206,6 +455,27 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         }
 
     } // #pragma omp parallel region
+    endPhase(time, PH_KERNEL, &t0);
+
+    // Convert to a single precision output
+    if (single) {
+        float* yf = mxGetData(plhs[0]);
+        for (i = 0; i<N; i++)
+            yf[i] = (float)yhat[i];
+        free(yhat);
+    }
+    endPhase(time, PH_OUTPUT, &t0);
+
+    // Return the timing and counters of the call?
+    if (nlhs>1) {
+        double kernels = 0, winmax = 0; // Number of kernel weights; Widest window
+        for (i = 0; i<N; i++) {
+            kernels += (double)(ubIdx[i]-lbIdx[i]);
+            winmax = winmax < ubIdx[i]-lbIdx[i] ? (double)(ubIdx[i]-lbIdx[i]) : winmax;
+        }
+        plhs[1] = statsStruct(time, kernels, (double)N, winmax,
+                              (double)(2*N*sizeof(int64) + (M+nbin+1+single*N)*sizeof(double)));
+    }
 
     // Release dynamically allocated arrays
     free(lbIdx);